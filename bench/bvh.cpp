@@ -0,0 +1,80 @@
+/**
+ * Benchmark of GeometrySet::intersect (BVH) against a plain linear scan over
+ * all objects, for scenes of random spheres of increasing size.
+ */
+
+#include "ray/geometry.h"
+#include "ray/types.h"
+#include "util/stopwatch.h"
+#include <limits>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace ray;
+
+int main()
+{
+	RNG rng = {};
+	auto uniform = std::uniform_real_distribution<double>(-1.0, 1.0);
+	auto mat = Material();
+
+	fmt::print("{:>8} {:>14} {:>14} {:>10}\n", "objects", "bvh [M/s]",
+	           "linear [M/s]", "mismatch");
+	for (int n : {1, 10, 100, 1000, 10000, 100000})
+	{
+		// random spheres in a box, with total volume roughly independent of n
+		double size = std::cbrt((double)n);
+		std::vector<std::shared_ptr<const Geometry>> objects;
+		GeometrySet world;
+		for (int i = 0; i < n; ++i)
+		{
+			auto s = std::make_shared<Sphere>(0.3, mat);
+			s->translate(size * vec3{uniform(rng), uniform(rng), uniform(rng)});
+			objects.push_back(s);
+			world.add(s);
+		}
+		world.build();
+
+		// rays from random points on the boundary towards the interior
+		int ray_count = 200000;
+		std::vector<Ray> rays;
+		for (int i = 0; i < ray_count; ++i)
+		{
+			auto a = 2.0 * size * util::normalize(random_sphere(rng));
+			auto b = size * vec3{uniform(rng), uniform(rng), uniform(rng)};
+			rays.push_back(Ray(a, b - a));
+		}
+
+		util::Stopwatch sw_bvh, sw_linear;
+		std::vector<double> ts(ray_count);
+		sw_bvh.start();
+		for (int i = 0; i < ray_count; ++i)
+		{
+			Hit hit;
+			hit.t = std::numeric_limits<double>::infinity();
+			world.intersect(rays[i], hit);
+			ts[i] = hit.t;
+		}
+		sw_bvh.stop();
+
+		// linear scan is too slow for large scenes, so test fewer rays
+		int linear_count = std::min(ray_count, (int)(1e8 / n));
+		int mismatch = 0;
+		sw_linear.start();
+		for (int i = 0; i < linear_count; ++i)
+		{
+			Hit hit;
+			hit.t = std::numeric_limits<double>::infinity();
+			for (auto &obj : objects)
+				obj->intersect(rays[i], hit);
+			if (hit.t != ts[i])
+				++mismatch;
+		}
+		sw_linear.stop();
+
+		fmt::print("{:>8} {:>14.4f} {:>14.4f} {:>10}\n", n,
+		           ray_count / sw_bvh.secs() * 1e-6,
+		           linear_count / sw_linear.secs() * 1e-6, mismatch);
+	}
+}
@@ -0,0 +1,73 @@
+/**
+ * Build time and quality of the BVH builders, on the triangles of torus
+ * knots of increasing size: binned SAH and LBVH, each on one thread and on
+ * all cores. Quality is the SAH cost of the tree, and the closest-hit rate
+ * of a Mesh built with the same settings.
+ */
+
+#include "ray/geometry.h"
+#include "ray/types.h"
+#include "util/stopwatch.h"
+#include <limits>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace ray;
+
+int main()
+{
+	RNG rng = {};
+	auto uniform = std::uniform_real_distribution<double>(-1.0, 1.0);
+	auto material = Material();
+	int cores = std::max(1u, std::thread::hardware_concurrency());
+
+	std::vector<Ray> rays;
+	for (int i = 0; i < 100000; ++i)
+	{
+		auto a = 2.0 * util::normalize(random_sphere(rng));
+		auto b = vec3{uniform(rng), uniform(rng), 0.2 * uniform(rng)};
+		rays.push_back(Ray(a, b - a));
+	}
+
+	for (int n : {300, 1000, 3000})
+	{
+		fmt::print("{} triangles\n", 2 * n * (n / 10));
+		fmt::print("  {:<6} {:>8} {:>10} {:>10} {:>12}\n", "", "threads",
+		           "build[s]", "SAH cost", "closest[M/s]");
+		for (auto method : {BVH::Method::sah, BVH::Method::lbvh})
+			for (int threads : {1, cores})
+			{
+				BVH::default_method = method;
+				BVH::build_threads = threads;
+				auto before = BVH::build_stats().size();
+				auto mesh = torus_knot(2, 3, n, n / 10, material,
+				                       Mesh::Layout::indexed);
+				auto stats = BVH::build_stats();
+				if (stats.size() != before + 1)
+				{
+					fmt::print(stderr, "expected one BVH build, got {}\n",
+					           stats.size() - before);
+					return 1;
+				}
+				auto &b = stats.back();
+
+				util::Stopwatch sw;
+				sw.start();
+				for (auto &ray : rays)
+				{
+					Hit hit;
+					hit.t = std::numeric_limits<double>::infinity();
+					mesh->intersect(ray, hit);
+				}
+				sw.stop();
+
+				fmt::print("  {:<6} {:>8} {:>10.3f} {:>10.2f} {:>12.3f}\n",
+				           method == BVH::Method::sah ? "sah" : "lbvh",
+				           threads, b.secs, b.sah_cost,
+				           rays.size() / sw.secs() * 1e-6);
+				if (cores == 1)
+					break;
+			}
+	}
+}
@@ -0,0 +1,151 @@
+/**
+ * Benchmark of binary against wide (4 and 8 children) BVH traversal, on
+ * triangle meshes of increasing size. Wide nodes are tested with boxes in
+ * double and single precision, and quantized to 16 and 8 bits relative to
+ * the parent box. Measures closest-hit and any-hit queries with the same
+ * rays for all variants, and the node memory per triangle. All variants
+ * find the same primitives, so hits must match exactly.
+ */
+
+#include "queries.h"
+#include "ray/bvh.h"
+#include "ray/geometry.h"
+#include "ray/types.h"
+#include <array>
+#include <cmath>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+using namespace ray;
+
+struct Triangles
+{
+	std::vector<vec3> co;
+	std::vector<std::array<int, 3>> tris;
+
+	bool intersect(Ray const &ray, int32_t i, double tmax, double &t) const
+	{
+		auto [a, b, c] = tris[i];
+		double u, v;
+		return triangle_intersect(ray, co[a], co[b] - co[a], co[c] - co[a], t,
+		                          u, v) &&
+		       t > 0 && t < tmax;
+	}
+};
+
+/** torus knot tessellated into n*m quads (same shape as torus_knot()) */
+Triangles make_knot(int n, int m)
+{
+	Triangles r;
+	for (int i = 0; i <= n; ++i)
+		for (int j = 0; j <= m; ++j)
+		{
+			double t = (2.0 * i / n + 0.5) * 3.141592654;
+			double o = (2.0 * j / m - 1) * 3.141592654;
+			double rr = 1 + 0.2 * std::cos(2 * t) + 0.05 * std::cos(o);
+			r.co.push_back(vec3{rr * std::cos(3 * t), rr * std::sin(3 * t),
+			                    0.2 * std::sin(2 * t) + 0.05 * std::sin(o)});
+		}
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < m; ++j)
+		{
+			int a = i * (m + 1) + j, b = (i + 1) * (m + 1) + j;
+			r.tris.push_back({a, b, b + 1});
+			r.tris.push_back({a, b + 1, a + 1});
+		}
+	return r;
+}
+
+/** query interface of run_queries() for a BVH over the triangles */
+template <typename B> struct Traversal
+{
+	B const &bvh;
+	Triangles const &mesh;
+
+	bool intersect(Ray const &ray, Hit &hit) const
+	{
+		bool r = false;
+		bvh.traverse(ray, hit.t, [&](int32_t i) {
+			double t;
+			if (mesh.intersect(ray, i, hit.t, t))
+			{
+				hit.t = t;
+				r = true;
+			}
+		});
+		return r;
+	}
+
+	bool occluded(Ray const &ray, double tmax) const
+	{
+		return bvh.any_of(ray, tmax, [&](int32_t i) {
+			double t;
+			return mesh.intersect(ray, i, tmax, t);
+		});
+	}
+};
+
+int main()
+{
+	RNG rng = {};
+	auto uniform = std::uniform_real_distribution<double>(-1.0, 1.0);
+
+	for (int n : {100, 300, 1000})
+	{
+		auto mesh = make_knot(n, n / 10);
+
+		std::vector<AABB> boxes;
+		for (auto [a, b, c] : mesh.tris)
+		{
+			AABB box;
+			box.extend(mesh.co[a]);
+			box.extend(mesh.co[b]);
+			box.extend(mesh.co[c]);
+			boxes.push_back(box);
+		}
+		auto bvh = BVH(boxes);
+		auto bvh4 = WideBVH<4>(bvh);
+		auto bvh8 = WideBVH<8>(bvh);
+		auto bvh4f = WideBVH<4, float>(bvh);
+		auto bvh8f = WideBVH<8, float>(bvh);
+		auto bvh4q16 = WideBVH<4, uint16_t>(bvh);
+		auto bvh8q16 = WideBVH<8, uint16_t>(bvh);
+		auto bvh4q8 = WideBVH<4, uint8_t>(bvh);
+		auto bvh8q8 = WideBVH<8, uint8_t>(bvh);
+		auto tris = mesh.tris;
+		for (size_t i = 0; i < tris.size(); ++i)
+			mesh.tris[i] = tris[bvh.primitives()[i]];
+
+		// rays from random points around the knot towards its center region
+		std::vector<Ray> rays;
+		for (int i = 0; i < 200000; ++i)
+		{
+			auto a = 2.0 * util::normalize(random_sphere(rng));
+			auto b = vec3{uniform(rng), uniform(rng), 0.2 * uniform(rng)};
+			rays.push_back(Ray(a, b - a));
+		}
+		std::vector<double> ts(rays.size(), -1);
+
+		fmt::print("{} triangles\n", mesh.tris.size());
+		print_queries_header(
+		    fmt::format(" {:>9} {:>12}", "nodes", "bytes/tri"));
+		auto run = [&](char const *name, auto const &bvh) {
+			size_t node_size = sizeof(bvh.nodes()[0]);
+			auto extra = fmt::format(
+			    " {:>9} {:>12.1f}", bvh.node_count(),
+			    (double)(bvh.node_count() * node_size) / mesh.tris.size());
+			using B = std::decay_t<decltype(bvh)>;
+			run_queries(name, Traversal<B>{bvh, mesh}, rays, ts, extra, 0.0);
+		};
+		run("binary", bvh);
+		run("wide 4", bvh4);
+		run("wide 8", bvh8);
+		run("wide 4f", bvh4f);
+		run("wide 8f", bvh8f);
+		run("wide 4q16", bvh4q16);
+		run("wide 8q16", bvh8q16);
+		run("wide 4q8", bvh4q8);
+		run("wide 8q8", bvh8q8);
+	}
+}
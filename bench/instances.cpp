@@ -0,0 +1,82 @@
+/**
+ * Memory and trace speed of many copies of one torus knot in a grid: as
+ * instances of one Mesh (sharing triangles and BVH), against separately
+ * built meshes. Memory is the growth of the resident set while building the
+ * scene (Linux only).
+ */
+
+#include "ray/geometry.h"
+#include "ray/types.h"
+#include "util/stopwatch.h"
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <unistd.h>
+#include <vector>
+
+using namespace ray;
+
+/** resident memory of this process in bytes */
+size_t resident_memory()
+{
+	size_t pages = 0, resident = 0;
+	std::ifstream("/proc/self/statm") >> pages >> resident;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+void run(char const *name, int count, bool instanced)
+{
+	auto material = Material();
+	int side = (int)std::ceil(std::sqrt((double)count));
+
+	size_t mem_before = resident_memory();
+	util::Stopwatch sw_build;
+	sw_build.start();
+	GeometrySet world;
+	{
+		auto knot = torus_knot(2, 3, 200, 20, material);
+		for (int i = 0; i < count; ++i)
+		{
+			auto mesh = instanced ? std::make_shared<Mesh>(*knot, material)
+			                      : torus_knot(2, 3, 200, 20, material);
+			mesh->translate(vec3{3.0 * (i % side), 3.0 * (i / side), 0.0});
+			world.add(mesh);
+		}
+		world.build();
+	}
+	sw_build.stop();
+	size_t mem = resident_memory() - mem_before;
+
+	// rays from above the grid, towards random points on it
+	RNG rng = {};
+	auto uniform = std::uniform_real_distribution<double>(0.0, 1.0);
+	double size = 3.0 * side;
+	util::Stopwatch sw_trace;
+	int ray_count = 200000, hit_count = 0;
+	sw_trace.start();
+	for (int i = 0; i < ray_count; ++i)
+	{
+		auto from = vec3{size * uniform(rng), size * uniform(rng), 5.0};
+		auto to = vec3{size * uniform(rng), size * uniform(rng), 0.0};
+		Hit hit;
+		hit.t = std::numeric_limits<double>::infinity();
+		hit_count += world.intersect(Ray(from, to - from), hit);
+	}
+	sw_trace.stop();
+
+	fmt::print("{:<10} {:>9} {:>10.3f} {:>12.1f} {:>12.3f} {:>9.3f}\n", name,
+	           count, sw_build.secs(), mem / 1048576.0,
+	           ray_count / sw_trace.secs() * 1e-6,
+	           (double)hit_count / ray_count);
+}
+
+int main()
+{
+	fmt::print("{:<10} {:>9} {:>10} {:>12} {:>12} {:>9}\n", "", "copies",
+	           "build[s]", "memory[MiB]", "rays[M/s]", "hit rate");
+	for (int count : {1, 100, 10000})
+		run("instances", count, true);
+	for (int count : {1, 100})
+		run("meshes", count, false);
+}
@@ -0,0 +1,80 @@
+/**
+ * Benchmark of the Mesh layouts: vertex indices only, precomputed edges per
+ * triangle, and the same packed into SIMD groups, plus the watertight tests
+ * on the first and last. The packed layout also runs with either BVH node
+ * format, the other rows use the automatic choice (quantized for the
+ * largest knot). Measures closest-hit and any-hit queries with the same rays
+ * for all, on torus knots of increasing size. The tests round differently,
+ * so hits are compared with a small tolerance.
+ */
+
+#include "queries.h"
+#include "ray/geometry.h"
+#include "ray/types.h"
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace ray;
+
+/** memory per triangle, the extra column */
+std::string bytes_per_tri(Mesh const &mesh)
+{
+	return fmt::format(" {:>12.1f}", (double)mesh.memory() / mesh.size());
+}
+
+int main()
+{
+	RNG rng = {};
+	auto uniform = std::uniform_real_distribution<double>(-1.0, 1.0);
+	auto material = Material();
+
+	for (int n : {100, 300, 1000})
+	{
+		auto indexed =
+		    torus_knot(2, 3, n, n / 10, material, Mesh::Layout::indexed);
+		auto precomputed =
+		    torus_knot(2, 3, n, n / 10, material, Mesh::Layout::precomputed);
+		auto packed =
+		    torus_knot(2, 3, n, n / 10, material, Mesh::Layout::packed);
+		auto indexed_wt = torus_knot(2, 3, n, n / 10, material,
+		                             Mesh::Layout::indexed,
+		                             Mesh::Test::watertight);
+		auto packed_wt = torus_knot(2, 3, n, n / 10, material,
+		                            Mesh::Layout::packed,
+		                            Mesh::Test::watertight);
+		auto packed_2s = torus_knot(2, 3, n, n / 10, material,
+		                            Mesh::Layout::packed,
+		                            Mesh::Test::two_sided);
+		auto packed_full =
+		    torus_knot(2, 3, n, n / 10, material, Mesh::Layout::packed,
+		               Mesh::Test::fast, Mesh::Nodes::full);
+		auto packed_q16 =
+		    torus_knot(2, 3, n, n / 10, material, Mesh::Layout::packed,
+		               Mesh::Test::fast, Mesh::Nodes::quantized);
+
+		// rays from random points around the knot towards its center region
+		std::vector<Ray> rays;
+		for (int i = 0; i < 200000; ++i)
+		{
+			auto a = 2.0 * util::normalize(random_sphere(rng));
+			auto b = vec3{uniform(rng), uniform(rng), 0.2 * uniform(rng)};
+			rays.push_back(Ray(a, b - a));
+		}
+		std::vector<double> ts(rays.size(), -1);
+
+		fmt::print("{} triangles\n", indexed->size());
+		print_queries_header(fmt::format(" {:>12}", "bytes/tri"));
+		auto run = [&](char const *name, Mesh const &mesh) {
+			run_queries(name, mesh, rays, ts, bytes_per_tri(mesh));
+		};
+		run("indexed", *indexed);
+		run("precomputed", *precomputed);
+		run("packed", *packed);
+		run("indexed wt", *indexed_wt);
+		run("packed wt", *packed_wt);
+		run("packed 2s", *packed_2s);
+		run("packed full", *packed_full);
+		run("packed q16", *packed_q16);
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+/**
+ * Fixture shared by the query benchmarks: closest-hit and any-hit queries
+ * with the same rays against several variants of a scene, one table row per
+ * variant. The benchmarks only supply the scenes and the rays.
+ */
+
+#include "ray/geometry.h"
+#include "ray/types.h"
+#include "util/stopwatch.h"
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+/** table header. 'extra' are additional (formatted) column titles */
+inline void print_queries_header(std::string const &extra = "")
+{
+	fmt::print("  {:<12} {:>12} {:>12}{} {:>9}\n", "", "closest[M/s]",
+	           "any[M/s]", extra, "mismatch");
+}
+
+/**
+ * Run all rays through 'scene', which has intersect(ray, hit) and
+ * occluded(ray, tmax) as Geometry and GeometrySet. The first variant stores
+ * the distances of its hits in 'ts' (initialized to -1), the later ones are
+ * compared to them with a relative 'tolerance', as the variants may round
+ * differently. 'extra' is printed before the mismatch count.
+ */
+template <typename Scene>
+void run_queries(char const *name, Scene const &scene,
+                 std::vector<ray::Ray> const &rays, std::vector<double> &ts,
+                 std::string const &extra = "", double tolerance = 1e-9)
+{
+	util::Stopwatch sw_closest, sw_any;
+	int mismatch = 0;
+	sw_closest.start();
+	for (size_t k = 0; k < rays.size(); ++k)
+	{
+		ray::Hit hit;
+		hit.t = std::numeric_limits<double>::infinity();
+		scene.intersect(rays[k], hit);
+		if (ts[k] == -1)
+			ts[k] = hit.t;
+		else if (ts[k] != hit.t &&
+		         !(std::abs(ts[k] - hit.t) <= tolerance * ts[k]))
+			++mismatch;
+	}
+	sw_closest.stop();
+
+	// any-hit queries for the same rays, up to half the distance of the
+	// first hit and a bit beyond, so that both outcomes are common
+	sw_any.start();
+	for (size_t k = 0; k < rays.size(); ++k)
+	{
+		double tmax = k % 2 ? 0.5 * ts[k] : 1.5 * ts[k];
+		if (scene.occluded(rays[k], tmax) != (ts[k] < tmax))
+			++mismatch;
+	}
+	sw_any.stop();
+
+	fmt::print("  {:<12} {:>12.3f} {:>12.3f}{} {:>9}\n", name,
+	           rays.size() / sw_closest.secs() * 1e-6,
+	           rays.size() / sw_any.secs() * 1e-6, extra, mismatch);
+}
@@ -0,0 +1,59 @@
+/**
+ * Benchmark of diffuse direction sampling: the old normalize(n +
+ * random_sphere()) against random_cosine_hemisphere(). Both should give the
+ * same distribution, which is checked by the first two moments of cos(theta)
+ * (exact values 2/3 and 1/2).
+ */
+
+#include "ray/types.h"
+#include "util/stopwatch.h"
+#include <vector>
+
+using namespace ray;
+
+template <typename F> void run(std::string const &name, F &&f)
+{
+	RNG rng = {};
+
+	// a few fixed normals, so the basis construction is not optimized away
+	std::vector<vec3> normals;
+	for (int i = 0; i < 64; ++i)
+		normals.push_back(util::normalize(random_sphere(rng)));
+
+	int64_t n = 20'000'000;
+	double sum = 0, sum2 = 0;
+	util::Stopwatch sw;
+	sw.start();
+	for (int64_t i = 0; i < n; ++i)
+	{
+		auto const &normal = normals[i % normals.size()];
+		double c = util::dot(f(normal, rng), normal);
+		sum += c;
+		sum2 += c * c;
+	}
+	sw.stop();
+
+	fmt::print("{:<24} {:>8.2f} M/s   <cos> = {:.4f}   <cos^2> = {:.4f}\n",
+	           name, n / sw.secs() * 1e-6, sum / n, sum2 / n);
+}
+
+int main()
+{
+	run("normal + random_sphere", [](vec3 const &normal, RNG &rng) {
+		return util::normalize(normal + random_sphere(rng));
+	});
+	run("random_cosine_hemisphere", [](vec3 const &normal, RNG &rng) {
+		return random_cosine_hemisphere(normal, rng);
+	});
+
+	// accuracy of the polynomial sin/cos
+	double err = 0;
+	for (int i = 0; i < 1000000; ++i)
+	{
+		double u = i / 1000000.0, c, s;
+		sincos_2pi(u, c, s);
+		err = std::max(err, std::abs(c - std::cos(2 * 3.141592653589793 * u)));
+		err = std::max(err, std::abs(s - std::sin(2 * 3.141592653589793 * u)));
+	}
+	fmt::print("sincos_2pi max error = {:.2e}\n", err);
+}
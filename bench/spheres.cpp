@@ -0,0 +1,61 @@
+/**
+ * Benchmark of SphereSet against the same spheres as individual Sphere
+ * objects in a GeometrySet. Measures closest-hit and any-hit queries with
+ * the same rays for both variants.
+ */
+
+#include "queries.h"
+#include "ray/geometry.h"
+#include "ray/types.h"
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace ray;
+
+int main()
+{
+	RNG rng = {};
+	auto uniform = std::uniform_real_distribution<double>(0.0, 1.0);
+	auto material = Material(json{{"diffuse", 0.5}});
+
+	for (int n : {100, 1000, 10000, 100000})
+	{
+		// spheres in a unit cube, covering about a quarter of its volume
+		double radius = 0.4 * std::cbrt(1.0 / n);
+		std::vector<vec3> centers;
+		std::vector<double> radii;
+		for (int i = 0; i < n; ++i)
+		{
+			centers.push_back(vec3{uniform(rng), uniform(rng), uniform(rng)});
+			radii.push_back(radius * (0.5 + uniform(rng)));
+		}
+
+		GeometrySet single, set;
+		for (int i = 0; i < n; ++i)
+		{
+			auto sphere = std::make_shared<Sphere>(radii[i], material);
+			sphere->translate(centers[i]);
+			single.add(sphere);
+		}
+		single.build();
+		set.add(std::make_shared<SphereSet>(
+		    centers, radii, std::vector<Material>(n, material)));
+		set.build();
+
+		// rays from random points around the cube through its inside
+		std::vector<Ray> rays;
+		for (int i = 0; i < 200000; ++i)
+		{
+			auto a = vec3{0.5, 0.5, 0.5} + 2.0 * random_sphere(rng);
+			auto b = vec3{uniform(rng), uniform(rng), uniform(rng)};
+			rays.push_back(Ray(a, b - a));
+		}
+		std::vector<double> ts(rays.size(), -1);
+
+		fmt::print("{} spheres\n", n);
+		print_queries_header();
+		run_queries("Sphere", single, rays, ts);
+		run_queries("SphereSet", set, rays, ts);
+	}
+}
@@ -0,0 +1,134 @@
+/**
+ * Accuracy and throughput of Torus::first_hit(). Reference hits are found by
+ * bracketing the first sign change of the implicit torus function along the
+ * ray and bisecting, all in long double. Grazing rays can touch the torus
+ * without a sign change, so a few 'extra' hits are expected.
+ */
+
+#include "ray/geometry.h"
+#include "ray/types.h"
+#include "util/stopwatch.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+using namespace ray;
+
+using real = long double;
+
+/** first hit with 0 < t < infinity, or -1 if there is none */
+real reference_hit(Ray const &ray, real R, real r)
+{
+	real o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+	real d[3] = {ray.dir.x, ray.dir.y, ray.dir.z};
+	auto f = [&](real t) {
+		real p[3] = {o[0] + t * d[0], o[1] + t * d[1], o[2] + t * d[2]};
+		real s = p[0] * p[0] + p[1] * p[1] + p[2] * p[2] + R * R - r * r;
+		return s * s - 4 * R * R * (p[0] * p[0] + p[1] * p[1]);
+	};
+
+	// segment of the ray inside the bounding sphere
+	real a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+	real b = o[0] * d[0] + o[1] * d[1] + o[2] * d[2];
+	real c = o[0] * o[0] + o[1] * o[1] + o[2] * o[2] - (R + r) * (R + r);
+	real disc = b * b - a * c;
+	if (disc < 0)
+		return -1;
+	real t0 = std::max((real)0, (-b - std::sqrt(disc)) / a);
+	real t1 = (-b + std::sqrt(disc)) / a;
+	if (t1 <= 0)
+		return -1;
+
+	int steps = 4000;
+	real lo = t0, flo = f(t0);
+	for (int i = 1; i <= steps; ++i)
+	{
+		real hi = t0 + (t1 - t0) * i / steps;
+		if ((f(hi) < 0) != (flo < 0))
+		{
+			for (int k = 0; k < 100; ++k)
+			{
+				real mid = (lo + hi) / 2;
+				if ((f(mid) < 0) == (flo < 0))
+					lo = mid;
+				else
+					hi = mid;
+			}
+			return (lo + hi) / 2;
+		}
+		lo = hi;
+	}
+	return -1;
+}
+
+void run(double R, double r, RNG &rng)
+{
+	auto uniform = std::uniform_real_distribution<double>(-1.0, 1.0);
+	auto torus = Torus(R, r, Material());
+
+	// rays from random points around the torus towards its bounding box,
+	// most of which miss
+	std::vector<Ray> rays;
+	for (int i = 0; i < 200000; ++i)
+	{
+		auto a = 3.0 * R * util::normalize(random_sphere(rng));
+		auto b = vec3{(R + r) * uniform(rng), (R + r) * uniform(rng),
+		              r * uniform(rng)};
+		rays.push_back(Ray(a, b - a));
+	}
+
+	// best of a few passes, as a single one is short
+	std::vector<double> ts(rays.size());
+	double secs = std::numeric_limits<double>::infinity();
+	for (int pass = 0; pass < 10; ++pass)
+	{
+		util::Stopwatch sw;
+		sw.start();
+		for (size_t k = 0; k < rays.size(); ++k)
+			if (!torus.first_hit(rays[k],
+			                     std::numeric_limits<double>::infinity(),
+			                     ts[k]))
+				ts[k] = -1;
+		sw.stop();
+		secs = std::min(secs, sw.secs());
+	}
+
+	int hits = 0, missed = 0, extra = 0, bad = 0;
+	double max_err = 0;
+	for (size_t k = 0; k < rays.size(); ++k)
+	{
+		real ref = reference_hit(rays[k], R, r);
+		if (ref < 0 && ts[k] < 0)
+			continue;
+		if (ref < 0)
+			++extra;
+		else if (ts[k] < 0)
+			++missed;
+		else
+		{
+			++hits;
+			double err = (double)(std::abs(ts[k] - ref) / ref);
+			max_err = std::max(max_err, err);
+			if (err > 1e-6)
+				++bad;
+		}
+	}
+
+	fmt::print("  {:>5} {:>5} {:>9.3f} {:>8} {:>8} {:>8} {:>8} {:>10.2e}\n",
+	           R, r, rays.size() / secs * 1e-6, hits, missed, extra, bad,
+	           max_err);
+}
+
+int main()
+{
+	RNG rng = {};
+	fmt::print("  {:>5} {:>5} {:>9} {:>8} {:>8} {:>8} {:>8} {:>10}\n", "R",
+	           "r", "[M/s]", "hits", "missed", "extra", "err>1e-6",
+	           "max err");
+	run(0.375, 0.125, rng);
+	run(1.0, 0.25, rng);
+	run(1.0, 0.05, rng);
+	run(1.0, 0.01, rng);
+}
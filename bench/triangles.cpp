@@ -0,0 +1,175 @@
+/**
+ * Throughput of the ray-triangle tests: the scalar triangle_intersect() one
+ * triangle at a time, against the SIMD version on a TriangleGroup, for both
+ * the fast and the watertight test. All see the same small random triangles
+ * and rays, about a third of the tests hit. Then the number of rays that
+ * slip through the shared edge of two triangles, aimed right at it, with
+ * the triangles tested alone and as part of two different groups.
+ */
+
+#include "ray/geometry.h"
+#include "ray/types.h"
+#include "util/stopwatch.h"
+#include <random>
+#include <vector>
+
+using namespace ray;
+
+int main()
+{
+	constexpr int W = TriangleGroup::width;
+	constexpr int n_groups = 256; // fits into L1, measures the test itself
+	constexpr int n_rays = 20000;
+
+	RNG rng = {};
+	auto uniform = std::uniform_real_distribution<double>(-1.0, 1.0);
+	auto rand_vec = [&]() {
+		return vec3{uniform(rng), uniform(rng), uniform(rng)};
+	};
+
+	// vertices, and edges for the scalar fast test (as Layout::precomputed)
+	std::vector<vec3> as, bs, cs, edges1, edges2;
+	std::vector<TriangleGroup> groups(n_groups);
+	for (int g = 0; g < n_groups; ++g)
+		for (int k = 0; k < W; ++k)
+		{
+			auto a = 0.2 * rand_vec();
+			auto b = a + rand_vec(), c = a + rand_vec();
+			as.push_back(a);
+			bs.push_back(b);
+			cs.push_back(c);
+			edges1.push_back(b - a);
+			edges2.push_back(c - a);
+			for (int j = 0; j < 3; ++j)
+			{
+				groups[g].a[j][k] = a[j];
+				groups[g].b[j][k] = b[j];
+				groups[g].c[j][k] = c[j];
+			}
+		}
+
+	std::vector<Ray> rays;
+	for (int i = 0; i < n_rays; ++i)
+	{
+		auto a = 3.0 * util::normalize(random_sphere(rng));
+		rays.push_back(Ray(a, 0.3 * rand_vec() - a));
+	}
+
+	double const tmax = 10;
+	int64_t n_tests = (int64_t)n_rays * n_groups * W;
+
+	// f(ray) returns the number of triangles hit
+	auto run = [&](std::string const &name, auto &&f) {
+		util::Stopwatch sw;
+		int64_t hits = 0;
+		sw.start();
+		for (auto &ray : rays)
+			hits += f(ray);
+		sw.stop();
+		fmt::print("{:<18} {:>14.1f} {:>12}\n", name,
+		           n_tests / sw.secs() * 1e-6, hits);
+	};
+
+	fmt::print("{:<18} {:>14} {:>12}\n", "", "tests[M/s]", "hits");
+	run("scalar", [&](Ray const &ray) {
+		int hits = 0;
+		for (size_t i = 0; i < as.size(); ++i)
+		{
+			double t, u, v;
+			if (triangle_intersect(ray, as[i], edges1[i], edges2[i], t, u,
+			                       v) &&
+			    t > 0 && t <= tmax)
+				++hits;
+		}
+		return hits;
+	});
+	run(fmt::format("simd x{}", W), [&](Ray const &ray) {
+		int hits = 0;
+		for (auto &g : groups)
+		{
+			double t[W], u[W], v[W];
+			hits += __builtin_popcount(triangle_intersect(ray, g, tmax, t, u,
+			                                              v));
+		}
+		return hits;
+	});
+	run("watertight scalar", [&](Ray const &ray) {
+		auto sheared = ShearedRay(ray);
+		int hits = 0;
+		for (size_t i = 0; i < as.size(); ++i)
+		{
+			double t, u, v;
+			if (triangle_intersect(sheared, as[i], bs[i], cs[i], true, t, u,
+			                       v) &&
+			    t > 0 && t <= tmax)
+				++hits;
+		}
+		return hits;
+	});
+	run(fmt::format("watertight x{}", W), [&](Ray const &ray) {
+		auto sheared = ShearedRay(ray);
+		int hits = 0;
+		for (auto &g : groups)
+		{
+			double t[W], u[W], v[W];
+			hits += __builtin_popcount(
+			    triangle_intersect(sheared, g, true, tmax, t, u, v));
+		}
+		return hits;
+	});
+
+	// two front-facing triangles (a, b, c) and (b, a, d) in the z=0 plane,
+	// and rays from above through a random point of the edge (a, b). In the
+	// groups, each triangle is in a different slot of its own group.
+	int misses_fast = 0, misses_watertight = 0;
+	int misses_fast_group = 0, misses_watertight_group = 0;
+	TriangleGroup g1 = {}, g2 = {};
+	int const k1 = 0, k2 = W - 1;
+	int const n_edge = 1000000;
+	for (int i = 0; i < n_edge; ++i)
+	{
+		auto a = vec3{uniform(rng), uniform(rng), 0};
+		auto b = vec3{uniform(rng), uniform(rng), 0};
+		auto side = vec3{a.y - b.y, b.x - a.x, 0};
+		auto c = 0.5 * (a + b) + side, d = 0.5 * (a + b) - side;
+		if (util::cross(b - a, c - a).z < 0)
+			std::swap(a, b);
+		auto target = a + 0.5 * (uniform(rng) + 1) * (b - a);
+		auto from = vec3{uniform(rng), uniform(rng), 1 + uniform(rng)};
+		auto ray = Ray(from, target - from);
+
+		double t, u, v;
+		if (!triangle_intersect(ray, a, b - a, c - a, t, u, v) &&
+		    !triangle_intersect(ray, b, a - b, d - b, t, u, v))
+			++misses_fast;
+		auto sheared = ShearedRay(ray);
+		if (!triangle_intersect(sheared, a, b, c, true, t, u, v) &&
+		    !triangle_intersect(sheared, b, a, d, true, t, u, v))
+			++misses_watertight;
+
+		for (int j = 0; j < 3; ++j)
+		{
+			g1.a[j][k1] = a[j];
+			g1.b[j][k1] = b[j];
+			g1.c[j][k1] = c[j];
+			g2.a[j][k2] = b[j];
+			g2.b[j][k2] = a[j];
+			g2.c[j][k2] = d[j];
+		}
+		double ts[W], us[W], vs[W];
+		if (!triangle_intersect(ray, g1, tmax, ts, us, vs) &&
+		    !triangle_intersect(ray, g2, tmax, ts, us, vs))
+			++misses_fast_group;
+		if (!triangle_intersect(sheared, g1, true, tmax, ts, us, vs) &&
+		    !triangle_intersect(sheared, g2, true, tmax, ts, us, vs))
+			++misses_watertight_group;
+	}
+	fmt::print("\nrays through a shared edge missing both triangles:\n");
+	fmt::print("{:<18} {:>8} of {}\n", "fast", misses_fast, n_edge);
+	fmt::print("{:<18} {:>8} of {}\n", "watertight", misses_watertight,
+	           n_edge);
+	fmt::print("{:<18} {:>8} of {}\n", fmt::format("fast x{}", W),
+	           misses_fast_group, n_edge);
+	fmt::print("{:<18} {:>8} of {}\n", fmt::format("watertight x{}", W),
+	           misses_watertight_group, n_edge);
+}
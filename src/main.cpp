@@ -1,16 +1,25 @@
 #include "CLI/CLI.hpp"
 #include "ray/geometry.h"
 #include "ray/image.h"
+#include "ray/packet.h"
+#include "ray/sampler.h"
 #include "ray/scene.h"
+#include "ray/scheduler.h"
 #include "ray/types.h"
+#ifdef RAY_SDL
 #include "ray/window.h"
+#endif
 #include "util/random.h"
 #include "util/span.h"
 #include "util/stopwatch.h"
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <optional>
 #include <random>
+#include <thread>
 
 using namespace ray;
 
@@ -36,59 +45,509 @@ class Camera
 	}
 };
 
-RNG rng = {};
-int64_t ray_count = 0; // total number of rays shot
+/**
+ * per-thread state of the tracer. Aligned to a cache line, as every ray
+ * updates it (no false sharing between neighbouring workers)
+ */
+struct alignas(64) Worker
+{
+	RNG rng;
+	int64_t ray_count = 0;    // total number of rays shot by this thread
+	int64_t sample_count = 0; // number of pixel samples taken
+	int64_t tile_count = 0, steal_count = 0;
+	util::Stopwatch sw_busy;
+
+	explicit Worker(uint64_t seed) : rng(seed) {}
+};
+
+/** settings of the tracer that are fixed for the whole image */
+struct Options
+{
+	int max_depth = 10;
+	bool light_sampling = true; // next-event estimation
+	double noise_target = 0.0;  // adaptive sampling, 0 = off
+	bool sobol = true;          // low-discrepancy sampling (see Sampler)
+	bool packets = true;        // trace camera and shadow rays as packets
+	bool wavefront = false;     // see trace_wavefront()
+};
+
+/** state of a path while it is traced */
+struct Path
+{
+	Ray ray = Ray({0, 0, 0}, {0, 0, 0});
+	vec3 color = {0, 0, 0};
+	vec3 attenuation = {1, 1, 1}; // product of all attenuations so far
+	Material::Lobe lobe = Material::Lobe::none; // lobe of the previous bounce
+};
+
+/** ray towards a light, and the light it carries unless it is occluded */
+struct ShadowRay
+{
+	bool active = false;
+	Ray ray = Ray({0, 0, 0}, {0, 0, 0});
+	double tmax = 0;
+	vec3 light = {0, 0, 0};
+};
+
+/**
+ * Direct light at a hit point from one randomly chosen light source, for
+ * the diffuse part of the material (next-event estimation). Sets up the
+ * shadow ray, but does not trace it.
+ */
+void sample_lights(GeometrySet const &world, Hit const &hit,
+                   Sampler &sampler, ShadowRay &shadow)
+{
+	// draw before any early return, to keep the dimensions of the sampler
+	// aligned between paths
+	double u_light = sampler.next();
+	vec2 u_dir = sampler.next_2d();
+
+	auto &lights = world.lights();
+	if (lights.empty())
+		return;
+	auto albedo = hit.material->diffuse(hit.uv);
+	if (albedo.x == 0 && albedo.y == 0 && albedo.z == 0)
+		return;
 
-/** take a single color sample */
-vec3 sample(GeometrySet const &world, Ray const &ray, vec3 attenuation,
-            int depth)
+	auto &light = *lights[std::min(lights.size() - 1,
+	                               (size_t)(u_light * lights.size()))];
+	vec3 dir;
+	double pdf;
+	if (!light.sample_direction(hit.point, dir, pdf, u_dir))
+		return;
+	double cos_theta = util::dot(dir, hit.normal);
+	if (cos_theta <= 0)
+		return;
+
+	// find the point on the light. The shadow ray checks that nothing else
+	// is in between
+	auto ray = Ray(hit.point, dir);
+	Hit light_hit;
+	light_hit.t = std::numeric_limits<double>::infinity();
+	if (!light.intersect(ray, light_hit))
+		return;
+
+	auto glow = light.material().glow(dir, light_hit.normal, light_hit.uv);
+	shadow.active = true;
+	shadow.ray = ray;
+	shadow.tmax = light_hit.t * (1.0 - 1e-9);
+	shadow.light = albedo * glow *
+	               (cos_theta / (3.141592654 * pdf) * (double)lights.size());
+}
+
+/** russian roulette on low-contribution paths. False if the path ends */
+bool roulette(Path &path, Sampler &sampler)
 {
-	if (depth < 0)
-		return vec3{0, 0, 0};
+	double u = sampler.next();
+	double p = util::length(path.attenuation);
+	if (p >= 1.)
+		return true;
+	if (u >= p)
+		return false;
+	path.attenuation /= p;
+	return true;
+}
 
-	if (util::length(attenuation) < 1.)
+/**
+ * Handle the hit of 'path.ray': add emitted light and scatter into a new
+ * direction. With light sampling, also sets up a shadow ray, which already
+ * includes the attenuation of the path. Returns false if the path ends.
+ */
+bool shade(GeometrySet const &world, Path &path, Hit &hit,
+           Options const &options, Sampler &sampler, ShadowRay &shadow)
+{
+	if (util::dot(hit.normal, path.ray.dir) > 0) // should never happen (?)
+		hit.normal *= -1.0;
+	assert(std::abs(util::length(hit.normal) - 1.0) < 0.0001);
+	if (hit.material == nullptr)
 	{
-		if (std::bernoulli_distribution(util::length(attenuation))(rng))
-			attenuation /= util::length(attenuation);
-		else
-			return {0, 0, 0};
+		path.color += path.attenuation * vec3{1, 0, 1};
+		return false;
 	}
+	auto &mat = *hit.material;
 
-	ray_count += 1;
+	// light reaching a diffuse surface from lights that can be sampled
+	// directly is accounted for by sample_lights() at the previous hit
+	if (!(options.light_sampling && path.lobe == Material::Lobe::diffuse &&
+	      hit.geometry->can_sample_direction()))
+		path.color +=
+		    path.attenuation * mat.glow(path.ray.dir, hit.normal, hit.uv);
 
-	Hit hit;
-	hit.t = std::numeric_limits<double>::infinity();
-	if (world.intersect(ray, hit))
+	if (options.light_sampling)
 	{
-		if (util::dot(hit.normal, ray.dir) > 0) // should never happen (?)
-			hit.normal *= -1.0;
-		assert(std::abs(util::length(hit.normal) - 1.0) < 0.0001);
-		if (hit.material == nullptr)
-			return vec3{1, 0, 1};
-		assert(hit.material != nullptr);
-		auto &mat = *hit.material;
+		sample_lights(world, hit, sampler, shadow);
+		shadow.light *= path.attenuation;
+	}
 
-		vec3 color = mat.glow(ray.dir, hit.normal, hit.uv);
+	vec3 att;
+	vec3 new_dir;
+	path.lobe = mat.scatter(path.ray.dir, hit.normal, hit.uv, new_dir, att,
+	                        sampler);
+	if (path.lobe == Material::Lobe::none)
+		return false;
+	path.attenuation *= att;
+	path.ray = Ray(hit.point, new_dir);
+	return true;
+}
 
-		vec3 att;
-		vec3 new_dir;
-		if (mat.scatter_diffuse(ray.dir, hit.normal, hit.uv, new_dir, att, rng))
+/**
+ * Follow a path through the scene, starting at the given bounce. At each
+ * bounce, only one scattering lobe of the material is followed, so the cost
+ * per sample is linear in the depth.
+ */
+void trace(GeometrySet const &world, Path &path, int bounce,
+           Options const &options, Worker &worker, Sampler &sampler)
+{
+	for (; bounce <= options.max_depth; ++bounce)
+	{
+		sampler.start_bounce(bounce);
+		if (!roulette(path, sampler))
+			break;
+
+		worker.ray_count += 1;
+		Hit hit;
+		hit.t = std::numeric_limits<double>::infinity();
+		if (!world.intersect(path.ray, hit))
 		{
-			auto new_ray = Ray(hit.point, new_dir);
-			color += sample(world, new_ray, attenuation * att, depth - 1);
+			// auto t = 0.5 * (util::normalize(ray.dir).z + 1.0);
+			// color += attenuation * ((1.0 - t) * vec3(1.0, 1.0, 1.0) +
+			//                         t * vec3(0.5, 0.7, 1.0));
+			break;
 		}
-		if (mat.scatter_reflective(ray.dir, hit.normal, hit.uv, new_dir, att,
-		                           rng))
+
+		ShadowRay shadow;
+		bool more = shade(world, path, hit, options, sampler, shadow);
+		if (shadow.active)
 		{
-			auto new_ray = Ray(hit.point, new_dir);
-			color += sample(world, new_ray, attenuation * att, depth - 1);
+			worker.ray_count += 1;
+			if (!world.occluded(shadow.ray, shadow.tmax))
+				path.color += shadow.light;
 		}
-		return color * attenuation;
+		if (!more)
+			break;
 	}
+}
+
+/**
+ * Same as trace() from the first bounce, for up to one packet of paths
+ * ('mask'). The camera rays and their shadow rays are coherent, so they are
+ * traced as packets. Secondary bounces are not, so those fall back to single
+ * rays.
+ */
+void trace_packet(GeometrySet const &world, Path *paths, uint32_t mask,
+                  Options const &options, Worker &worker, Sampler *samplers)
+{
+	constexpr int K = RayPacket::size;
+	if (!mask)
+		return;
 
-	return {0, 0, 0};
-	// auto t = 0.5 * (util::normalize(ray.dir).z + 1.0);
-	// return (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+	RayPacket packet;
+	Hit hits[K];
+	for (int k = 0; k < K; ++k)
+		hits[k].t = std::numeric_limits<double>::infinity();
+	for_each_lane(mask, [&](int k) {
+		samplers[k].start_bounce(0);
+		roulette(paths[k], samplers[k]); // never ends a fresh path
+		packet.set(k, paths[k].ray);
+	});
+	worker.ray_count += __builtin_popcount(mask);
+	uint32_t hit_mask = world.intersect(packet, mask, hits);
+
+	RayPacket shadow_packet;
+	ShadowRay shadows[K];
+	double shadow_tmax[K] = {};
+	uint32_t shadow_mask = 0, more = 0;
+	for_each_lane(hit_mask, [&](int k) {
+		if (shade(world, paths[k], hits[k], options, samplers[k], shadows[k]))
+			more |= 1u << k;
+		if (shadows[k].active)
+		{
+			shadow_packet.set(k, shadows[k].ray);
+			shadow_tmax[k] = shadows[k].tmax;
+			shadow_mask |= 1u << k;
+		}
+	});
+	worker.ray_count += __builtin_popcount(shadow_mask);
+	uint32_t blocked = world.occluded(shadow_packet, shadow_mask, shadow_tmax);
+	for_each_lane(shadow_mask & ~blocked,
+	              [&](int k) { paths[k].color += shadows[k].light; });
+
+	for_each_lane(more, [&](int k) {
+		trace(world, paths[k], 1, options, worker, samplers[k]);
+	});
+}
+
+/**
+ * Sort key for rays: octant of the direction, then the origin along a Morton
+ * curve through 'bounds'. Rays with close keys are coherent.
+ */
+uint64_t ray_key(Ray const &ray, AABB const &bounds)
+{
+	auto spread = [](uint64_t v) {
+		v &= 0x3ff;
+		v = (v | (v << 16)) & 0x030000ff;
+		v = (v | (v << 8)) & 0x0300f00f;
+		v = (v | (v << 4)) & 0x030c30c3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	};
+	uint64_t key = 0;
+	for (int i = 0; i < 3; ++i)
+	{
+		// NaN (e.g. from an empty box) ends up as 0
+		double x = (ray.origin[i] - bounds.lo[i]) /
+		           (bounds.hi[i] - bounds.lo[i]) * 1024.0;
+		uint64_t q = x > 0 ? (x < 1023 ? (uint64_t)x : 1023) : 0;
+		key |= spread(q) << i;
+		key |= (uint64_t)(ray.dir[i] < 0) << (30 + i);
+	}
+	return key;
+}
+
+/**
+ * Breadth-first alternative to trace(), for a batch of paths at their first
+ * bounce. All paths advance one bounce at a time, in separate stages:
+ *   1) russian roulette, then sort the remaining rays by ray_key()
+ *   2) intersect them
+ *   3) shade all hits, grouped by material
+ *   4) trace the shadow rays, sorted like the other rays
+ * As in trace_packet(), rays of the first bounce are traced in packets (of
+ * neighbours in the sorted order), later bounces are too incoherent.
+ * This keeps geometry and materials hot in the cache across many paths, at
+ * the cost of storing the state of all of them. The expected image is the
+ * same as with trace().
+ */
+void trace_wavefront(GeometrySet const &world, std::vector<Path> &paths,
+                     std::vector<Sampler> &samplers, Options const &options,
+                     Worker &worker)
+{
+	constexpr int K = RayPacket::size;
+	auto bounds = world.bounds();
+	auto n = (int32_t)paths.size();
+
+	std::vector<int32_t> active(n);
+	for (int32_t i = 0; i < n; ++i)
+		active[i] = i;
+	std::vector<Hit> hits(n);
+	std::vector<ShadowRay> shadows(n);
+	std::vector<int32_t> hit_list, shadow_list;
+	std::vector<std::pair<uint64_t, int32_t>> keys;
+
+	// calls f(packet, mask, lanes) for consecutive groups of up to K rays
+	// in keys, where lanes[k] is the path of ray k
+	auto for_each_packet = [&](auto &&get_ray, auto &&f) {
+		for (size_t p = 0; p < keys.size(); p += K)
+		{
+			int m = (int)std::min(keys.size() - p, (size_t)K);
+			RayPacket packet;
+			int32_t lanes[K];
+			for (int k = 0; k < m; ++k)
+			{
+				lanes[k] = keys[p + k].second;
+				packet.set(k, get_ray(lanes[k]));
+			}
+			f(packet, (uint32_t)((1u << m) - 1), lanes);
+		}
+	};
+
+	for (int bounce = 0; bounce <= options.max_depth && !active.empty();
+	     ++bounce)
+	{
+		keys.clear();
+		for (int32_t i : active)
+		{
+			samplers[i].start_bounce(bounce);
+			if (roulette(paths[i], samplers[i]))
+				keys.push_back({ray_key(paths[i].ray, bounds), i});
+		}
+		std::sort(keys.begin(), keys.end());
+
+		worker.ray_count += keys.size();
+		hit_list.clear();
+		for_each_packet(
+		    [&](int32_t i) { return paths[i].ray; },
+		    [&](RayPacket const &packet, uint32_t mask, int32_t *lanes) {
+			    Hit h[K];
+			    for (int k = 0; k < K; ++k)
+				    h[k].t = std::numeric_limits<double>::infinity();
+			    uint32_t hit_mask = 0;
+			    if (options.packets && bounce == 0)
+				    hit_mask = world.intersect(packet, mask, h);
+			    else
+				    for_each_lane(mask, [&](int k) {
+					    if (world.intersect(packet[k], h[k]))
+						    hit_mask |= 1u << k;
+				    });
+			    for_each_lane(hit_mask, [&](int k) {
+				    hits[lanes[k]] = h[k];
+				    hit_list.push_back(lanes[k]);
+			    });
+		    });
+
+		std::sort(hit_list.begin(), hit_list.end(), [&](int32_t a, int32_t b) {
+			return hits[a].material < hits[b].material;
+		});
+		active.clear();
+		shadow_list.clear();
+		for (int32_t i : hit_list)
+		{
+			shadows[i] = ShadowRay();
+			if (shade(world, paths[i], hits[i], options, samplers[i],
+			          shadows[i]))
+				active.push_back(i);
+			if (shadows[i].active)
+				shadow_list.push_back(i);
+		}
+
+		keys.clear();
+		for (int32_t i : shadow_list)
+			keys.push_back({ray_key(shadows[i].ray, bounds), i});
+		std::sort(keys.begin(), keys.end());
+		worker.ray_count += keys.size();
+		for_each_packet(
+		    [&](int32_t i) { return shadows[i].ray; },
+		    [&](RayPacket const &packet, uint32_t mask, int32_t *lanes) {
+			    double tmax[K] = {};
+			    for_each_lane(mask,
+			                  [&](int k) { tmax[k] = shadows[lanes[k]].tmax; });
+			    uint32_t blocked = 0;
+			    if (options.packets && bounce == 0)
+				    blocked = world.occluded(packet, mask, tmax);
+			    else
+				    for_each_lane(mask, [&](int k) {
+					    if (world.occluded(packet[k], tmax[k]))
+						    blocked |= 1u << k;
+				    });
+			    for_each_lane(mask & ~blocked, [&](int k) {
+				    paths[lanes[k]].color += shadows[lanes[k]].light;
+			    });
+		    });
+	}
+}
+
+/** rectangular part of the image, rows [i0, i1) and columns [j0, j1) */
+struct Tile
+{
+	int i0, i1, j0, j1;
+};
+
+/** interleave the lower 16 bits of x and y */
+uint32_t morton_code(uint32_t x, uint32_t y)
+{
+	auto spread = [](uint32_t v) {
+		v &= 0xffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+	return spread(x) | spread(y) << 1;
+}
+
+/**
+ * Split image into tiles in Morton order, such that any contiguous range of
+ * tiles covers a compact area of the screen (and thus of the scene).
+ */
+std::vector<Tile> make_tiles(int width, int height, int tile_size)
+{
+	std::vector<std::pair<uint32_t, Tile>> tiles;
+	for (int i = 0; i < height; i += tile_size)
+		for (int j = 0; j < width; j += tile_size)
+			tiles.push_back(
+			    {morton_code(j / tile_size, i / tile_size),
+			     {i, std::min(i + tile_size, height), j,
+			      std::min(j + tile_size, width)}});
+	std::sort(tiles.begin(), tiles.end(), [](auto const &a, auto const &b) {
+		return a.first < b.first;
+	});
+
+	std::vector<Tile> r;
+	for (auto &tile : tiles)
+		r.push_back(tile.second);
+	return r;
+}
+
+/**
+ * Noise estimate of a pixel (per color channel), given the sum and the sum
+ * of squares of its n samples.
+ */
+vec3 pixel_noise(vec3 const &sum, vec3 const &sumSq, int n)
+{
+	auto mean = sum / (double)n;
+	return (sumSq / (double)n - mean * mean) / std::sqrt((double)n);
+}
+
+// number of samples before the noise estimate of a pixel is trusted
+constexpr int adaptive_min_samples = 16;
+
+// number of tiles traced together by the wavefront integrator
+constexpr int wavefront_tiles = 16;
+
+/**
+ * Add one sample to every pixel of some tiles. If options.noise_target > 0,
+ * pixels whose noise is already below it in all channels are skipped.
+ */
+void render_tiles(GeometrySet const &world, Camera const &camera,
+                  Tile const *tiles, int tile_count,
+                  util::ndspan<vec3, 2> image, util::ndspan<vec3, 2> imageSq,
+                  util::ndspan<int, 2> counts, Options const &options,
+                  Worker &worker)
+{
+	constexpr int K = RayPacket::size;
+	auto noise_target = options.noise_target;
+	auto width = (double)image.shape(1);
+	auto height = (double)image.shape(0);
+
+	// camera paths, in row order within each tile
+	std::vector<std::pair<int, int>> pixels;
+	std::vector<Path> paths;
+	std::vector<Sampler> samplers;
+	for (int t = 0; t < tile_count; ++t)
+	{
+		auto &tile = tiles[t];
+		for (int i = tile.i0; i < tile.i1; ++i)
+			for (int j = tile.j0; j < tile.j1; ++j)
+			{
+				if (noise_target > 0 && counts(i, j) >= adaptive_min_samples)
+				{
+					auto noise =
+					    pixel_noise(image(i, j), imageSq(i, j), counts(i, j));
+					if (noise.x < noise_target && noise.y < noise_target &&
+					    noise.z < noise_target)
+						continue;
+				}
+
+				auto &sampler =
+				    samplers.emplace_back(worker.rng, options.sobol);
+				sampler.start_pixel(i, j, counts(i, j));
+				auto jitter = sampler.next_2d();
+				paths.emplace_back().ray =
+				    camera.ray((j + jitter.x) / width, (i + jitter.y) / height);
+				pixels.push_back({i, j});
+			}
+	}
+
+	auto n = (int)paths.size();
+	if (options.wavefront)
+		trace_wavefront(world, paths, samplers, options, worker);
+	else if (options.packets)
+		for (int p = 0; p < n; p += K)
+			trace_packet(world, &paths[p], (1u << std::min(K, n - p)) - 1,
+			             options, worker, &samplers[p]);
+	else
+		for (int p = 0; p < n; ++p)
+			trace(world, paths[p], 0, options, worker, samplers[p]);
+
+	for (int p = 0; p < n; ++p)
+	{
+		auto [i, j] = pixels[p];
+		auto color = paths[p].color;
+		image(i, j) += color;
+		imageSq(i, j) += color * color;
+		counts(i, j) += 1;
+		worker.sample_count += 1;
+	}
 }
 
 int main(int argc, char *argv[])
@@ -102,16 +561,81 @@ int main(int argc, char *argv[])
 	std::string output_filename = "";
 	int sample_count = 100;
 	int width = 640, height = 480;
+	int thread_count = std::max(1u, std::thread::hardware_concurrency());
+	bool headless = false;
+	bool no_light_sampling = false;
+	bool no_packets = false;
+	bool wavefront = false;
+	double time_budget = 0.0;
+	std::string sampler_name = "sobol";
+	std::string bvh_name = "sah";
+	auto options = Options();
 
 	CLI::App app{"ray tracer"};
 	app.add_option("scene", scene_filename, "scene file in json format")
 	    ->required();
-	app.add_option("--samples", sample_count, "samples per pixel");
+	app.add_option("--samples", sample_count,
+	               "samples per pixel (maximum if adaptive)");
+	app.add_option("--noise-target", options.noise_target,
+	               "adaptive sampling: stop sampling pixels once their noise "
+	               "is below this (same unit as the noise statistic, not ppm)");
+	app.add_option("--time-budget", time_budget,
+	               "stop tracing after this many seconds (checked before "
+	               "every tile)");
 	app.add_option("--width", width, "width in pixels");
 	app.add_option("--height", height, "height in pixels");
+	app.add_option("--threads", thread_count,
+	               "number of threads (default: all cores)");
 	app.add_option("-o", output_filename,
 	               "output image file. Supported formats: png, bmp, tga, jpg");
+	app.add_flag("--headless", headless,
+	             "do not open a preview window (implied without SDL)");
+	app.add_flag("--no-light-sampling", no_light_sampling,
+	             "only find light sources by random bounces");
+	app.add_flag("--no-packets", no_packets,
+	             "trace all rays one by one instead of camera and shadow rays "
+	             "in packets");
+	app.add_flag("--wavefront", wavefront,
+	             "breadth-first tracing of many paths at once, with rays "
+	             "sorted for coherence");
+	app.add_option("--sampler", sampler_name,
+	               "sample generator: 'sobol' (scrambled low-discrepancy "
+	               "sequence, default) or 'random'");
+	app.add_option("--bvh", bvh_name,
+	               "BVH builder: 'sah' (best for tracing, default) or 'lbvh' "
+	               "(Morton codes, faster to build)");
 	CLI11_PARSE(app, argc, argv);
+	options.light_sampling = !no_light_sampling;
+	options.packets = !no_packets;
+	options.wavefront = wavefront;
+	if (thread_count < 1)
+	{
+		fmt::print(stderr, "invalid number of threads {}\n", thread_count);
+		return 1;
+	}
+	if (sampler_name != "sobol" && sampler_name != "random")
+	{
+		fmt::print(stderr, "unknown sampler '{}'\n", sampler_name);
+		return 1;
+	}
+	options.sobol = sampler_name == "sobol";
+	if (bvh_name != "sah" && bvh_name != "lbvh")
+	{
+		fmt::print(stderr, "unknown BVH builder '{}'\n", bvh_name);
+		return 1;
+	}
+	BVH::default_method =
+	    bvh_name == "sah" ? BVH::Method::sah : BVH::Method::lbvh;
+	BVH::build_threads = thread_count;
+
+#ifndef RAY_SDL
+	headless = true;
+#endif
+	if (headless && output_filename.empty())
+	{
+		fmt::print(stderr, "no output file given (-o), nothing to do\n");
+		return 1;
+	}
 
 	auto image_raw = std::vector<vec3>(width * height, vec3{0, 0, 0});
 	auto imageSq_raw = std::vector<vec3>(width * height, vec3{0, 0, 0});
@@ -119,6 +643,9 @@ int main(int argc, char *argv[])
 	    util::ndspan<vec3, 2>(image_raw, {(size_t)height, (size_t)width});
 	auto imageSq =
 	    util::ndspan<vec3, 2>(imageSq_raw, {(size_t)height, (size_t)width});
+	auto counts_raw = std::vector<int>(width * height, 0);
+	auto counts =
+	    util::ndspan<int, 2>(counts_raw, {(size_t)height, (size_t)width});
 
 	double fov = 3.141592654 * 0.5;
 	auto camera =
@@ -126,53 +653,142 @@ int main(int argc, char *argv[])
 
 	auto world = load_scene(scene_filename);
 
-	auto jitter = std::uniform_real_distribution<double>(0., 1.);
+	// one independent random stream per thread
+	auto workers = std::vector<Worker>();
+	for (int k = 0; k < thread_count; ++k)
+		workers.emplace_back(k);
+	auto tiles = make_tiles(width, height, 8);
+	auto scheduler = Scheduler(thread_count);
 
-	auto window = Window("Result", width, height);
+#ifdef RAY_SDL
+	auto window = std::optional<Window>();
+	auto preview_raw = std::vector<vec3>();
+	if (!headless)
+	{
+		window.emplace("Result", width, height);
+		preview_raw.resize(width * height);
+	}
+	auto preview =
+	    util::ndspan<vec3, 2>(preview_raw, {(size_t)height, (size_t)width});
+#endif
 
 	sw_setup.stop();
 
-	for (int sample_iter = 1; sample_iter <= sample_count && !window.quit;
-	     ++sample_iter)
+	int pass_count = 0;
+	for (int sample_iter = 1; sample_iter <= sample_count; ++sample_iter)
 	{
+#ifdef RAY_SDL
+		if (window && window->quit)
+			break;
+#endif
+		if (time_budget > 0 && sw_tracer.secs() >= time_budget)
+			break;
+
+		int64_t samples_before = 0;
+		for (auto &worker : workers)
+			samples_before += worker.sample_count;
+
+		// the budget is also checked before every tile, so the last pass can
+		// end early with some pixels sampled once less than the others
+		using clock = std::chrono::steady_clock;
+		auto deadline =
+		    clock::now() + std::chrono::duration_cast<clock::duration>(
+		                       std::chrono::duration<double>(
+		                           time_budget - sw_tracer.secs()));
+		auto out_of_time = [&] {
+			return time_budget > 0 && clock::now() >= deadline;
+		};
+
 		sw_tracer.start();
-		for (int i = 0; i < height; ++i)
-			for (int j = 0; j < width; ++j)
-			{
-				auto ray = camera.ray((j + jitter(rng)) / width,
-				                      (i + jitter(rng)) / height);
-				vec3 color = sample(world, ray, vec3(1, 1, 1), 10);
-				image(i, j) += color;
-				imageSq(i, j) += color * color;
-			}
+		scheduler.reset((int32_t)tiles.size());
+		std::vector<std::thread> threads;
+		for (int k = 0; k < thread_count; ++k)
+			threads.emplace_back([&, k] {
+				auto &worker = workers[k];
+				int batch_size = options.wavefront ? wavefront_tiles : 1;
+				std::vector<Tile> batch;
+				int32_t t;
+				bool stolen;
+				worker.sw_busy.start();
+				while (true)
+				{
+					batch.clear();
+					while ((int)batch.size() < batch_size && !out_of_time() &&
+					       scheduler.next(k, t, stolen))
+					{
+						batch.push_back(tiles[t]);
+						worker.tile_count += 1;
+						worker.steal_count += stolen;
+					}
+					if (batch.empty())
+						break;
+					render_tiles(world, camera, batch.data(), (int)batch.size(),
+					             image, imageSq, counts, options, worker);
+				}
+				worker.sw_busy.stop();
+			});
+		for (auto &thread : threads)
+			thread.join();
 		sw_tracer.stop();
-		sw_display.start();
-		window.update(image, 1. / sample_iter);
-		sw_display.stop();
+		pass_count = sample_iter;
+
+		int64_t samples_after = 0;
+		for (auto &worker : workers)
+			samples_after += worker.sample_count;
 
-		fmt::print("{} / {}\r", sample_iter, sample_count);
+#ifdef RAY_SDL
+		if (window)
+		{
+			// pixels can have different sample counts, so normalize each
+			sw_display.start();
+			for (int i = 0; i < height; ++i)
+				for (int j = 0; j < width; ++j)
+					preview(i, j) = image(i, j) / (double)counts(i, j);
+			window->update(preview);
+			sw_display.stop();
+		}
+#endif
+
+		fmt::print("{} / {} ({} pixels sampled)\r", sample_iter, sample_count,
+		           samples_after - samples_before);
 		std::cout.flush();
-	}
 
-	image /= (double)sample_count;
-	imageSq /= (double)sample_count;
+		// every pixel is below the noise target
+		if (samples_after == samples_before)
+			break;
+	}
 
 	double noise_sum = 0;
 	double noise_max = 0;
 	for (int i = 0; i < height; ++i)
 		for (int j = 0; j < width; ++j)
+		{
+			auto n = counts(i, j);
+			if (n == 0)
+				continue;
+			auto noise = pixel_noise(image(i, j), imageSq(i, j), n);
 			for (int c = 0; c < 3; ++c)
 			{
-				double noise =
-				    imageSq(i, j)[c] - image(i, j)[c] * image(i, j)[c];
-				noise /= std::sqrt((double)sample_count);
-				noise_sum += noise;
-				noise_max = std::max(noise_max, noise);
+				noise_sum += noise[c];
+				noise_max = std::max(noise_max, noise[c]);
 			}
+			image(i, j) /= (double)n;
+		}
 
 	if (output_filename.size())
 		write_image(output_filename, image, 2.2);
 
+	int64_t ray_count = 0;
+	int64_t total_samples = 0;
+	for (auto &worker : workers)
+	{
+		ray_count += worker.ray_count;
+		total_samples += worker.sample_count;
+	}
+	// samples that non-adaptive sampling would have taken in as many passes
+	int64_t saved_samples =
+	    (int64_t)pass_count * width * height - total_samples;
+
 	sw_total.stop();
 	fmt::print("\nall done\n");
 	fmt::print("--------------- statistics ---------------\n");
@@ -180,11 +796,31 @@ int main(int argc, char *argv[])
 	fmt::print("rays per pixel  = {:.3f}\n",
 	           (double)ray_count / (width * height));
 	fmt::print("rays per sample = {:.3f}\n",
-	           (double)ray_count / ((double)width * height * sample_count));
-	fmt::print("rays per second = {:.3f} M\n",
-	           ray_count / sw_tracer.secs() / 1000000.);
+	           (double)ray_count / total_samples);
+	fmt::print("samples saved   = {} ({:.1f} %) in {} passes\n", saved_samples,
+	           100.0 * saved_samples / ((double)pass_count * width * height),
+	           pass_count);
+	fmt::print("rays per second = {:.3f} M ({} threads)\n",
+	           ray_count / sw_tracer.secs() / 1000000., thread_count);
 	fmt::print("noise = {:.0f} ppm avg, {:.0f} ppm max\n",
 	           noise_sum / (3 * width * height) * 1e6, noise_max * 1e6);
+	fmt::print("---------------    BVH     ---------------\n");
+	auto bvh_stats = BVH::build_stats();
+	double bvh_secs = 0;
+	for (auto &b : bvh_stats)
+		bvh_secs += b.secs;
+	fmt::print("{} BVHs ({}) built in {:.3f} s ({:#4.1f} % of setup)\n",
+	           bvh_stats.size(), bvh_name, bvh_secs,
+	           bvh_secs / sw_setup.secs() * 100);
+	// the largest ones, which dominate both build time and tracing
+	std::sort(bvh_stats.begin(), bvh_stats.end(),
+	          [](auto &a, auto &b) { return a.primitives > b.primitives; });
+	for (size_t i = 0; i < std::min(bvh_stats.size(), (size_t)4); ++i)
+	{
+		auto &b = bvh_stats[i];
+		fmt::print("{:>9} prims: {:>9} nodes, {:.3f} s, SAH cost {:.2f}\n",
+		           b.primitives, b.nodes, b.secs, b.sah_cost);
+	}
 	fmt::print("---------------   timing   ---------------\n");
 	fmt::print("setup   = {:.3f} s ({:#4.1f} %)\n", sw_setup.secs(),
 	           sw_setup.secs() / sw_total.secs() * 100);
@@ -193,7 +829,19 @@ int main(int argc, char *argv[])
 	fmt::print("display = {:.3f} s ({:#4.1f} %%)\n", sw_display.secs(),
 	           sw_display.secs() / sw_total.secs() * 100);
 	fmt::print("total   = {:.3f} s\n", sw_total.secs());
+	fmt::print("---------------   threads  ---------------\n");
+	for (int k = 0; k < thread_count; ++k)
+	{
+		auto &w = workers[k];
+		fmt::print("thread {:>3}: busy = {:.3f} s, idle = {:.3f} s, "
+		           "{} tiles ({} stolen)\n",
+		           k, w.sw_busy.secs(), sw_tracer.secs() - w.sw_busy.secs(),
+		           w.tile_count, w.steal_count);
+	}
 
-	window.join();
+#ifdef RAY_SDL
+	if (window)
+		window->join();
+#endif
 	return 0;
 }
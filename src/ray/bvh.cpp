@@ -0,0 +1,475 @@
+#include "ray/bvh.h"
+
+#include "util/stopwatch.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+namespace ray {
+
+namespace {
+
+// relative cost of traversing a node vs intersecting a primitive
+constexpr double cost_traversal = 1.0;
+constexpr double cost_intersect = 1.0;
+
+constexpr int bin_count = 16;
+
+// subtrees smaller than this are not worth a thread of their own
+constexpr int32_t parallel_min = 4096;
+
+std::mutex stats_mutex;
+std::vector<BVH::BuildStats> stats;
+
+/** 'x' in [0, 1] to 21 bits, spread out to every third bit */
+uint64_t spread_bits(double x)
+{
+	auto v = (uint64_t)std::clamp(x * (1 << 21), 0.0, (1 << 21) - 1.0);
+	v = (v | v << 32) & 0x1f00000000ffff;
+	v = (v | v << 16) & 0x1f0000ff0000ff;
+	v = (v | v << 8) & 0x100f00f00f00f00f;
+	v = (v | v << 4) & 0x10c30c30c30c30c3;
+	v = (v | v << 2) & 0x1249249249249249;
+	return v;
+}
+
+/**
+ * Recursive top-down builder. Both methods share the recursion, they only
+ * differ in how a range of primitives is split. The upper levels of the
+ * tree are built in parallel, each thread into its own node array, which
+ * are merged when the thread is done.
+ */
+struct Builder
+{
+	std::vector<AABB> const &boxes;
+	std::vector<vec3> const &centers;
+	std::vector<uint64_t> const &codes; // Morton codes, same order as prims
+	std::vector<int32_t> &prims;
+	std::vector<BVH::Node> &nodes;
+	BVH::Method method;
+	int max_leaf_size;
+	int spawn_depth; // subtrees above this depth get their own thread
+
+	/** same builder, writing into a different node array */
+	Builder with_nodes(std::vector<BVH::Node> &other) const
+	{
+		return {boxes, centers, codes, prims, other, method, max_leaf_size,
+		        spawn_depth};
+	}
+
+	/**
+	 * Split sorted prims[begin, end) at the highest bit in which the Morton
+	 * codes differ. Returns -1 if the range is small enough for a leaf, or
+	 * if all codes are the same.
+	 */
+	int32_t split_morton(int32_t begin, int32_t end)
+	{
+		if (end - begin <= max_leaf_size)
+			return -1;
+		uint64_t a = codes[begin], b = codes[end - 1];
+		if (a == b)
+			return -1;
+		int bit = 63 - __builtin_clzll(a ^ b);
+		auto it = std::partition_point(
+		    codes.begin() + begin, codes.begin() + end,
+		    [&](uint64_t c) { return !(c >> bit & 1); });
+		return (int32_t)(it - codes.begin());
+	}
+
+	/**
+	 * Find the best split of prims[begin, end) with binned SAH. Returns the
+	 * position of the split in prims, or -1 if no split is better than
+	 * making a leaf.
+	 */
+	int32_t split_sah(int32_t begin, int32_t end, AABB const &box)
+	{
+		AABB cbox;
+		for (int32_t i = begin; i < end; ++i)
+			cbox.extend(centers[prims[i]]);
+
+		int best_axis = -1, best_bin = -1;
+		double best_cost = cost_intersect * (end - begin);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			double lo = cbox.lo[axis], hi = cbox.hi[axis];
+			if (!(hi > lo))
+				continue;
+			double scale = bin_count / (hi - lo);
+
+			std::array<AABB, bin_count> bin_box;
+			std::array<int32_t, bin_count> bin_n = {};
+			for (int32_t i = begin; i < end; ++i)
+			{
+				int b = (int)((centers[prims[i]][axis] - lo) * scale);
+				b = std::min(b, bin_count - 1);
+				bin_box[b].extend(boxes[prims[i]]);
+				bin_n[b] += 1;
+			}
+
+			// sweep from the right to get the cost of all right-hand sides
+			std::array<double, bin_count> right_cost;
+			AABB acc;
+			int32_t n = 0;
+			for (int b = bin_count - 1; b > 0; --b)
+			{
+				acc.extend(bin_box[b]);
+				n += bin_n[b];
+				right_cost[b] = acc.area() * n;
+			}
+
+			acc = AABB();
+			n = 0;
+			for (int b = 0; b < bin_count - 1; ++b)
+			{
+				acc.extend(bin_box[b]);
+				n += bin_n[b];
+				double cost =
+				    cost_traversal + cost_intersect *
+				                         (acc.area() * n + right_cost[b + 1]) /
+				                         box.area();
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = b;
+				}
+			}
+		}
+
+		if (best_axis == -1)
+			return -1;
+
+		double lo = cbox.lo[best_axis], hi = cbox.hi[best_axis];
+		double scale = bin_count / (hi - lo);
+		auto it = std::partition(
+		    prims.begin() + begin, prims.begin() + end, [&](int32_t p) {
+			    int b = (int)((centers[p][best_axis] - lo) * scale);
+			    return std::min(b, bin_count - 1) <= best_bin;
+		    });
+		return (int32_t)(it - prims.begin());
+	}
+
+	/** split prims[begin, end) in half along the longest axis */
+	int32_t split_median(int32_t begin, int32_t end, AABB const &box)
+	{
+		auto d = box.hi - box.lo;
+		int axis = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+		int32_t mid = begin + (end - begin) / 2;
+		std::nth_element(prims.begin() + begin, prims.begin() + mid,
+		                 prims.begin() + end, [&](int32_t a, int32_t b) {
+			                 return centers[a][axis] < centers[b][axis];
+		                 });
+		return mid;
+	}
+
+	void build(int32_t node, int32_t begin, int32_t end, int depth)
+	{
+		AABB box;
+		for (int32_t i = begin; i < end; ++i)
+			box.extend(boxes[prims[i]]);
+		nodes[node].box = box;
+
+		bool lbvh = method == BVH::Method::lbvh;
+		int32_t mid = -1;
+		if (end - begin > 1)
+		{
+			// close to the depth limit, fall back to balanced splits. For
+			// lbvh, prims are already sorted along the Morton curve.
+			if (depth < BVH::max_depth - 32)
+				mid = lbvh ? split_morton(begin, end)
+				           : split_sah(begin, end, box);
+			if (mid == -1 && end - begin > max_leaf_size)
+				mid = lbvh ? begin + (end - begin) / 2
+				           : split_median(begin, end, box);
+		}
+
+		if (mid == -1)
+		{
+			nodes[node].index = begin;
+			nodes[node].count = end - begin;
+			return;
+		}
+
+		auto child = (int32_t)nodes.size();
+		nodes.resize(nodes.size() + 2);
+		nodes[node].index = child;
+		nodes[node].count = 0;
+
+		if (depth >= spawn_depth || end - mid < parallel_min)
+		{
+			build(child, begin, mid, depth + 1);
+			build(child + 1, mid, end, depth + 1);
+			return;
+		}
+
+		// right subtree on a new thread. Its root goes into child + 1, the
+		// rest is appended, shifting all child indices accordingly.
+		std::vector<BVH::Node> right(1);
+		right.reserve(2 * (end - mid));
+		std::thread thread(
+		    [&] { with_nodes(right).build(0, mid, end, depth + 1); });
+		build(child, begin, mid, depth + 1);
+		thread.join();
+
+		auto offset = (int32_t)nodes.size() - 1;
+		for (auto &n : right)
+			if (n.count == 0)
+				n.index += offset;
+		nodes[child + 1] = right[0];
+		nodes.insert(nodes.end(), right.begin() + 1, right.end());
+	}
+};
+
+/** x rounded to T, such that the result is <= x */
+template <typename T> T round_down(double x)
+{
+	T r = (T)x;
+	return r > x ? std::nextafter(r, -std::numeric_limits<T>::infinity())
+	             : r;
+}
+
+/** x rounded to T, such that the result is >= x */
+template <typename T> T round_up(double x)
+{
+	T r = (T)x;
+	return r < x ? std::nextafter(r, std::numeric_limits<T>::infinity()) : r;
+}
+
+/**
+ * For quantized nodes, choose the frame such that codes 0 and max cover
+ * 'box', the box of the node itself. Nothing to do otherwise.
+ */
+template <typename Node> void set_frame(Node &node, AABB const &box)
+{
+	using T = std::remove_reference_t<decltype(node.lo[0][0])>;
+	if constexpr (std::is_integral_v<T>)
+	{
+		constexpr double qmax = std::numeric_limits<T>::max();
+		for (int i = 0; i < 3; ++i)
+		{
+			float base = round_down<float>(box.lo[i]);
+			float scale = round_up<float>((box.hi[i] - base) / qmax);
+			while (base + qmax * scale < box.hi[i])
+				scale = std::nextafter(scale,
+				                       std::numeric_limits<float>::infinity());
+			node.base[i] = base;
+			node.scale[i] = scale;
+		}
+	}
+	else
+	{
+		(void)node;
+		(void)box;
+	}
+}
+
+template <typename Node>
+void set_child(Node &node, int k, AABB const &box, int32_t index,
+               int32_t count)
+{
+	using T = std::remove_reference_t<decltype(node.lo[0][0])>;
+	for (int i = 0; i < 3; ++i)
+	{
+		if constexpr (std::is_integral_v<T>)
+		{
+			// codes rounded outwards, checked with the exact decoding
+			constexpr double qmax = std::numeric_limits<T>::max();
+			double base = node.base[i], scale = node.scale[i];
+			double lo = 0, hi = 0;
+			if (box.empty())
+				; // unused slot, never tested
+			else if (scale == 0)
+				hi = qmax;
+			else
+			{
+				lo = std::clamp(std::floor((box.lo[i] - base) / scale), 0.0,
+				                qmax);
+				while (lo > 0 && base + lo * scale > box.lo[i])
+					--lo;
+				hi = std::clamp(std::ceil((box.hi[i] - base) / scale), 0.0,
+				                qmax);
+				while (hi < qmax && base + hi * scale < box.hi[i])
+					++hi;
+			}
+			assert(box.empty() || (base + lo * scale <= box.lo[i] &&
+			                       base + hi * scale >= box.hi[i]));
+			node.lo[i][k] = (T)lo;
+			node.hi[i][k] = (T)hi;
+		}
+		else
+		{
+			node.lo[i][k] = round_down<T>(box.lo[i]);
+			node.hi[i][k] = round_up<T>(box.hi[i]);
+		}
+	}
+	node.index[k] = index;
+	assert(count <= std::numeric_limits<decltype(+node.count[k])>::max());
+	node.count[k] = count;
+}
+
+} // namespace
+
+std::vector<BVH::BuildStats> BVH::build_stats()
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	return stats;
+}
+
+BVH::BVH(std::vector<AABB> const &boxes, Method method, int max_leaf_size)
+{
+	if (boxes.empty())
+		return;
+
+	util::Stopwatch sw;
+	sw.start();
+
+	prims_.resize(boxes.size());
+	for (size_t i = 0; i < boxes.size(); ++i)
+		prims_[i] = (int32_t)i;
+
+	std::vector<vec3> centers;
+	centers.reserve(boxes.size());
+	for (auto &b : boxes)
+		centers.push_back(b.center());
+
+	std::vector<uint64_t> codes;
+	if (method == Method::lbvh)
+	{
+		AABB cbox;
+		for (auto &c : centers)
+			cbox.extend(c);
+		auto scale = cbox.hi - cbox.lo;
+		for (int i = 0; i < 3; ++i)
+			scale[i] = scale[i] > 0 ? 1 / scale[i] : 0;
+
+		std::vector<std::pair<uint64_t, int32_t>> order;
+		order.reserve(boxes.size());
+		for (size_t i = 0; i < boxes.size(); ++i)
+		{
+			auto p = centers[i] - cbox.lo;
+			order.push_back({spread_bits(p.x * scale.x) << 2 |
+			                     spread_bits(p.y * scale.y) << 1 |
+			                     spread_bits(p.z * scale.z),
+			                 (int32_t)i});
+		}
+		std::sort(order.begin(), order.end());
+		codes.reserve(boxes.size());
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			codes.push_back(order[i].first);
+			prims_[i] = order[i].second;
+		}
+	}
+
+	// two subtrees per level and thread, for some load balancing
+	int threads = build_threads > 0 ? build_threads
+	                                : (int)std::thread::hardware_concurrency();
+	int spawn_depth = 1;
+	while ((1 << (spawn_depth - 1)) < 2 * threads && threads > 1)
+		++spawn_depth;
+
+	nodes_.reserve(2 * boxes.size());
+	nodes_.resize(1);
+	Builder{boxes, centers, codes, prims_, nodes_, method, max_leaf_size,
+	        spawn_depth}
+	    .build(0, 0, (int32_t)boxes.size(), 1);
+
+	sw.stop();
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	stats.push_back({method, prims_.size(), nodes_.size(), sw.secs(),
+	                 sah_cost()});
+}
+
+double BVH::sah_cost() const
+{
+	if (nodes_.empty() || !(nodes_[0].box.area() > 0))
+		return 0.0;
+	double cost = 0.0;
+	for (auto &node : nodes_)
+		cost += node.box.area() * (node.count ? cost_intersect * node.count
+		                                      : cost_traversal);
+	return cost / nodes_[0].box.area();
+}
+
+template <int N, typename T>
+int32_t WideBVH<N, T>::collapse(std::vector<BVH::Node> const &bin, int32_t b)
+{
+	// replace the largest inner child by its two children until full
+	std::array<int32_t, N> children;
+	int n = 0;
+	children[n++] = bin[b].index;
+	children[n++] = bin[b].index + 1;
+	while (n < N)
+	{
+		int best = -1;
+		for (int k = 0; k < n; ++k)
+			if (bin[children[k]].count == 0 &&
+			    (best == -1 ||
+			     bin[children[k]].box.area() > bin[children[best]].box.area()))
+				best = k;
+		if (best == -1)
+			break;
+		auto c = children[best];
+		children[best] = bin[c].index;
+		children[n++] = bin[c].index + 1;
+	}
+
+	Node node;
+	node.size = n;
+	set_frame(node, bin[b].box);
+	for (int k = 0; k < N; ++k)
+		set_child(node, k, k < n ? bin[children[k]].box : AABB(), 0, 0);
+
+	auto r = (int32_t)nodes_.size();
+	nodes_.push_back(node);
+	for (int k = 0; k < n; ++k)
+	{
+		auto const &c = bin[children[k]];
+		if (c.count)
+		{
+			nodes_[r].index[k] = c.index;
+			nodes_[r].count[k] = c.count;
+		}
+		else
+			nodes_[r].index[k] = collapse(bin, children[k]);
+	}
+	return r;
+}
+
+template <int N, typename T>
+WideBVH<N, T>::WideBVH(BVH const &bvh) : prims_(bvh.primitives())
+{
+	auto &bin = bvh.nodes();
+	if (bin.empty())
+		return;
+
+	if (bin[0].count == 0)
+	{
+		collapse(bin, 0);
+		return;
+	}
+
+	// root is a leaf, so make a node with a single child
+	Node node;
+	node.size = 1;
+	set_frame(node, bin[0].box);
+	set_child(node, 0, bin[0].box, bin[0].index, bin[0].count);
+	for (int k = 1; k < N; ++k)
+		set_child(node, k, AABB(), 0, 0);
+	nodes_.push_back(node);
+}
+
+template class WideBVH<4, double>;
+template class WideBVH<8, double>;
+template class WideBVH<4, float>;
+template class WideBVH<8, float>;
+template class WideBVH<4, uint16_t>;
+template class WideBVH<8, uint16_t>;
+template class WideBVH<4, uint8_t>;
+template class WideBVH<8, uint8_t>;
+
+} // namespace ray
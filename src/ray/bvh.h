@@ -0,0 +1,785 @@
+#pragma once
+
+/** bounding boxes and bounding volume hierarchies */
+
+#include "ray/packet.h"
+#include "ray/types.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ray {
+
+/** axis-aligned bounding box. Default-constructed box is empty */
+struct AABB
+{
+	static constexpr double inf = std::numeric_limits<double>::infinity();
+
+	vec3 lo = {inf, inf, inf};
+	vec3 hi = {-inf, -inf, -inf};
+
+	AABB() = default;
+	AABB(vec3 const &lo, vec3 const &hi) : lo(lo), hi(hi) {}
+
+	static AABB infinite() { return {{-inf, -inf, -inf}, {inf, inf, inf}}; }
+
+	bool empty() const
+	{
+		return !(lo.x <= hi.x && lo.y <= hi.y && lo.z <= hi.z);
+	}
+
+	bool finite() const
+	{
+		for (int i = 0; i < 3; ++i)
+			if (!std::isfinite(lo[i]) || !std::isfinite(hi[i]))
+				return false;
+		return true;
+	}
+
+	void extend(vec3 const &p)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			lo[i] = std::min(lo[i], p[i]);
+			hi[i] = std::max(hi[i], p[i]);
+		}
+	}
+
+	void extend(AABB const &b)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			lo[i] = std::min(lo[i], b.lo[i]);
+			hi[i] = std::max(hi[i], b.hi[i]);
+		}
+	}
+
+	vec3 center() const { return 0.5 * (lo + hi); }
+
+	/** surface area (zero for empty boxes) */
+	double area() const
+	{
+		if (empty())
+			return 0.0;
+		auto d = hi - lo;
+		return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	/**
+	 * Slab test. 'inv_dir' is the component-wise inverse of the ray
+	 * direction. Returns true if the box overlaps the segment [0, tmax] of
+	 * the ray, in which case 'tnear' is set to the entry point.
+	 */
+	bool intersect(vec3 const &origin, vec3 const &inv_dir, double tmax,
+	               double &tnear) const
+	{
+		double t0 = 0.0, t1 = tmax;
+		for (int i = 0; i < 3; ++i)
+		{
+			double a = (lo[i] - origin[i]) * inv_dir[i];
+			double b = (hi[i] - origin[i]) * inv_dir[i];
+			if (a > b)
+				std::swap(a, b);
+			// written such that NaN (from 0*inf) does not shrink the interval
+			t0 = a > t0 ? a : t0;
+			t1 = b < t1 ? b : t1;
+		}
+		tnear = t0;
+		return t0 <= t1;
+	}
+};
+
+/**
+ * Bounding volume hierarchy over an abstract set of primitives, built with
+ * the surface area heuristic (SAH). Only the bounding boxes of the primitives
+ * are needed for construction.
+ *
+ * After construction, the owner is expected to reorder its primitives
+ * according to 'primitives()', such that each leaf refers to a contiguous
+ * range. 'traverse' then reports positions in this new order.
+ */
+class BVH
+{
+  public:
+	struct Node
+	{
+		AABB box;
+		int32_t index; // inner: first child (second is index+1), leaf: first
+		               // primitive
+		int32_t count; // number of primitives in leaf, 0 for inner nodes
+	};
+
+	/** traversal uses a fixed-size stack, so the builder limits the depth */
+	static constexpr int max_depth = 64;
+
+	enum class Method
+	{
+		sah, // binned surface area heuristic, best trace performance
+		lbvh // splits at the bits of sorted Morton codes, faster to build
+	};
+
+	/** used by the constructor without explicit method (e.g. from the CLI) */
+	inline static Method default_method = Method::sah;
+
+	/** threads used by the builder, 0 for all cores */
+	inline static int build_threads = 0;
+
+	/** one per BVH built, for the statistics output */
+	struct BuildStats
+	{
+		Method method;
+		size_t primitives;
+		size_t nodes;
+		double secs;
+		double sah_cost;
+	};
+
+	/** all BVHs built so far (thread-safe) */
+	static std::vector<BuildStats> build_stats();
+
+  private:
+	std::vector<Node> nodes_;
+	std::vector<int32_t> prims_;
+
+  public:
+	BVH() = default;
+	explicit BVH(std::vector<AABB> const &boxes, int max_leaf_size = 4)
+	    : BVH(boxes, default_method, max_leaf_size)
+	{}
+	BVH(std::vector<AABB> const &boxes, Method method, int max_leaf_size = 4);
+
+	/** number of primitives */
+	size_t size() const { return prims_.size(); }
+	size_t node_count() const { return nodes_.size(); }
+	std::vector<Node> const &nodes() const { return nodes_; }
+
+	/**
+	 * Expected cost of a random ray according to the surface area
+	 * heuristic, relative to hitting the root box. Lower is better.
+	 */
+	double sah_cost() const;
+
+	/** primitive order, i.e. leaf position -> original index */
+	std::vector<int32_t> const &primitives() const { return prims_; }
+
+	/**
+	 * Calls 'f(i)' for every primitive 'i' in a leaf whose box is hit by the
+	 * ray segment [0, tmax]. 'tmax' is typically a reference to 'hit.t',
+	 * which 'f' shrinks whenever it finds a closer hit. This culls all
+	 * subtrees behind the closest hit found so far.
+	 */
+	template <typename F>
+	void traverse(Ray const &ray, double const &tmax, F &&f) const
+	{
+		if (nodes_.empty())
+			return;
+
+		auto inv_dir = vec3{1.0 / ray.dir.x, 1.0 / ray.dir.y, 1.0 / ray.dir.z};
+
+		double tnear;
+		if (!nodes_[0].box.intersect(ray.origin, inv_dir, tmax, tnear))
+			return;
+
+		std::pair<int32_t, double> stack[max_depth];
+		int sp = 0;
+		int32_t cur = 0;
+		while (true)
+		{
+			auto const &node = nodes_[cur];
+			if (node.count)
+			{
+				for (int32_t i = node.index; i < node.index + node.count; ++i)
+					f(i);
+			}
+			else
+			{
+				int32_t a = node.index, b = node.index + 1;
+				double ta, tb;
+				bool hit_a = nodes_[a].box.intersect(ray.origin, inv_dir,
+				                                     tmax, ta);
+				bool hit_b = nodes_[b].box.intersect(ray.origin, inv_dir,
+				                                     tmax, tb);
+				if (hit_a && hit_b)
+				{
+					// visit the nearer child first, remember the other one
+					if (tb < ta)
+					{
+						std::swap(a, b);
+						std::swap(ta, tb);
+					}
+					assert(sp < max_depth);
+					stack[sp++] = {b, tb};
+					cur = a;
+					continue;
+				}
+				else if (hit_a)
+				{
+					cur = a;
+					continue;
+				}
+				else if (hit_b)
+				{
+					cur = b;
+					continue;
+				}
+			}
+
+			// pop next node, skipping those behind the current closest hit
+			do
+			{
+				if (sp == 0)
+					return;
+				--sp;
+			} while (stack[sp].second > tmax);
+			cur = stack[sp].first;
+		}
+	}
+
+	/**
+	 * Calls 'f(i)' for primitives in leaves whose box is hit by the ray
+	 * segment [0, tmax], until one call returns true. Returns whether that
+	 * happened. Nodes are visited in no particular order, which is fine for
+	 * any-hit queries like shadow rays.
+	 */
+	template <typename F>
+	bool any_of(Ray const &ray, double tmax, F &&f) const
+	{
+		if (nodes_.empty())
+			return false;
+
+		auto inv_dir = vec3{1.0 / ray.dir.x, 1.0 / ray.dir.y, 1.0 / ray.dir.z};
+
+		int32_t stack[max_depth + 1];
+		int sp = 0;
+		stack[sp++] = 0;
+		while (sp)
+		{
+			auto const &node = nodes_[stack[--sp]];
+			double tnear;
+			if (!node.box.intersect(ray.origin, inv_dir, tmax, tnear))
+				continue;
+			if (node.count)
+			{
+				for (int32_t i = node.index; i < node.index + node.count; ++i)
+					if (f(i))
+						return true;
+			}
+			else
+			{
+				assert(sp + 2 <= max_depth + 1);
+				stack[sp++] = node.index + 1;
+				stack[sp++] = node.index;
+			}
+		}
+		return false;
+	}
+};
+
+/**
+ * BVH with up to N children per node, made by collapsing a binary BVH. The
+ * child boxes of a node are stored as structure-of-arrays, so that a ray is
+ * tested against all of them at once (AVX-512 for N = 8, AVX for N = 4,
+ * plain loops otherwise). This reduces the number of nodes visited and keeps
+ * the box tests in vector registers. Primitive order is the same as in the
+ * binary BVH.
+ *
+ * The child boxes are stored with scalar type T. With T = float, boxes are
+ * rounded outwards, so the traversal finds the same primitives while nodes
+ * take about half the memory. With T = uint8_t or uint16_t, child boxes are
+ * quantized relative to the box of the node itself (rounded outwards too),
+ * which shrinks nodes further at the cost of looser boxes and decoding. The
+ * slab test itself is always done in double.
+ */
+template <int N, typename T = double> class WideBVH
+{
+	static_assert(N >= 2 && N <= 32);
+	static_assert(std::is_same_v<T, float> || std::is_same_v<T, double> ||
+	              std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t>);
+
+  public:
+	static constexpr bool quantized = std::is_integral_v<T>;
+
+	/** child coordinate q of axis i is base[i] + q * scale[i] */
+	struct Frame
+	{
+		float base[3], scale[3];
+	};
+	struct NoFrame
+	{};
+
+	struct alignas(quantized ? 32 : 64) Node
+	    : std::conditional_t<quantized, Frame, NoFrame>
+	{
+		// child boxes. Slots k >= size are unused: empty boxes, or for
+		// quantized nodes the degenerate box at 'base', so they are only
+		// skipped because the box test masks them out by 'size'.
+		T lo[3][N], hi[3][N];
+		int32_t index[N]; // inner child: node, leaf child: first primitive
+		// number of primitives of leaf child, 0 for inner (leaves are small)
+		std::conditional_t<quantized, uint8_t, int32_t> count[N];
+		int32_t size; // number of children in use (slots 0 .. size-1)
+	};
+
+	static constexpr int max_depth = BVH::max_depth;
+
+  private:
+	std::vector<Node> nodes_;
+	std::vector<int32_t> prims_;
+
+	int32_t collapse(std::vector<BVH::Node> const &bin, int32_t b);
+
+	/** 1/d, but large instead of infinite for d = 0, which avoids 0*inf */
+	static vec3 inverse(vec3 const &d)
+	{
+		vec3 r;
+		for (int i = 0; i < 3; ++i)
+			r[i] = d[i] == 0 ? std::copysign(1e300, d[i]) : 1.0 / d[i];
+		return r;
+	}
+
+	/**
+	 * Box coordinate q of axis i, in world space. For quantized nodes, the
+	 * product is exact, so this is the same with or without FMA.
+	 */
+	static double decode(Node const &node, T q, int i)
+	{
+		if constexpr (quantized)
+			return node.base[i] + (double)q * node.scale[i];
+		else
+			return q;
+	}
+
+#ifdef __AVX512F__
+	/** load 8 box coordinates of axis i, converted to double */
+	static __m512d load8(Node const &node, T const *p, int i)
+	{
+		// (maskz variants, see the GCC 12 note in intersect_children())
+		if constexpr (std::is_same_v<T, float>)
+			return _mm512_maskz_cvtps_pd(0xff, _mm256_load_ps(p));
+		else if constexpr (std::is_same_v<T, double>)
+			return _mm512_load_pd(p);
+		else
+		{
+			__m256i q;
+			if constexpr (std::is_same_v<T, uint8_t>)
+				q = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *)p));
+			else
+				q = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i const *)p));
+			__m512d x = _mm512_maskz_cvtepi32_pd(0xff, q);
+			return _mm512_maskz_fmadd_pd(0xff, x, _mm512_set1_pd(node.scale[i]),
+			                             _mm512_set1_pd(node.base[i]));
+		}
+	}
+#endif
+#ifdef __AVX__
+	/** load 4 box coordinates of axis i, converted to double */
+	static __m256d load4(Node const &node, T const *p, int i)
+	{
+		if constexpr (std::is_same_v<T, float>)
+			return _mm256_cvtps_pd(_mm_load_ps(p));
+		else if constexpr (std::is_same_v<T, double>)
+			return _mm256_load_pd(p);
+		else
+		{
+			__m128i q;
+			if constexpr (std::is_same_v<T, uint8_t>)
+			{
+				int32_t bytes;
+				std::memcpy(&bytes, p, 4);
+				q = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+			}
+			else
+				q = _mm_cvtepu16_epi32(_mm_loadl_epi64((__m128i const *)p));
+			return _mm256_add_pd(_mm256_set1_pd(node.base[i]),
+			                     _mm256_mul_pd(_mm256_cvtepi32_pd(q),
+			                                   _mm256_set1_pd(node.scale[i])));
+		}
+	}
+#endif
+
+	/**
+	 * Slab test against all children of a node. Returns the bitmask of
+	 * children that overlap the ray segment [0, tmax], and sets 'tnear' to
+	 * their entry points.
+	 */
+	static uint32_t intersect_children(Node const &node, vec3 const &origin,
+	                                   vec3 const &inv_dir, double tmax,
+	                                   double *tnear)
+	{
+		uint32_t used = node.size == 32 ? ~0u : (1u << node.size) - 1;
+#ifdef __AVX512F__
+		if constexpr (N == 8)
+		{
+			__m512d t0 = _mm512_setzero_pd();
+			__m512d t1 = _mm512_set1_pd(tmax);
+			for (int i = 0; i < 3; ++i)
+			{
+				__m512d o = _mm512_set1_pd(origin[i]);
+				__m512d inv = _mm512_set1_pd(inv_dir[i]);
+				__m512d a = _mm512_mul_pd(
+				    _mm512_sub_pd(load8(node, node.lo[i], i), o), inv);
+				__m512d b = _mm512_mul_pd(
+				    _mm512_sub_pd(load8(node, node.hi[i], i), o), inv);
+				// (unmasked min/max trigger a bogus -Wmaybe-uninitialized
+				// in GCC 12)
+				t0 = _mm512_maskz_max_pd(0xff, t0,
+				                         _mm512_maskz_min_pd(0xff, a, b));
+				t1 = _mm512_maskz_min_pd(0xff, t1,
+				                         _mm512_maskz_max_pd(0xff, a, b));
+			}
+			_mm512_storeu_pd(tnear, t0);
+			return _mm512_mask_cmp_pd_mask((__mmask8)used, t0, t1,
+			                               _CMP_LE_OQ);
+		}
+#endif
+#ifdef __AVX__
+		if constexpr (N == 4)
+		{
+			__m256d t0 = _mm256_setzero_pd();
+			__m256d t1 = _mm256_set1_pd(tmax);
+			for (int i = 0; i < 3; ++i)
+			{
+				__m256d o = _mm256_set1_pd(origin[i]);
+				__m256d inv = _mm256_set1_pd(inv_dir[i]);
+				__m256d a = _mm256_mul_pd(
+				    _mm256_sub_pd(load4(node, node.lo[i], i), o), inv);
+				__m256d b = _mm256_mul_pd(
+				    _mm256_sub_pd(load4(node, node.hi[i], i), o), inv);
+				t0 = _mm256_max_pd(t0, _mm256_min_pd(a, b));
+				t1 = _mm256_min_pd(t1, _mm256_max_pd(a, b));
+			}
+			_mm256_storeu_pd(tnear, t0);
+			return used &
+			       _mm256_movemask_pd(_mm256_cmp_pd(t0, t1, _CMP_LE_OQ));
+		}
+#endif
+		uint32_t mask = 0;
+		for (int k = 0; k < N; ++k)
+		{
+			double t0 = 0.0, t1 = tmax;
+			for (int i = 0; i < 3; ++i)
+			{
+				double a = (decode(node, node.lo[i][k], i) - origin[i]) *
+				           inv_dir[i];
+				double b = (decode(node, node.hi[i][k], i) - origin[i]) *
+				           inv_dir[i];
+				t0 = std::max(t0, std::min(a, b));
+				t1 = std::min(t1, std::max(a, b));
+			}
+			tnear[k] = t0;
+			mask |= (uint32_t)(t0 <= t1) << k;
+		}
+		return used & mask;
+	}
+
+	/** traverse() of the subtree (or leaf if count > 0) at 'index' */
+	template <typename F>
+	void traverse_from(int32_t index, int32_t count, vec3 const &origin,
+	                   vec3 const &inv_dir, double const &tmax, F &&f) const
+	{
+		// stack of children still to visit. Children of one node are pushed
+		// sorted, such that the nearest one is visited first
+		struct Entry
+		{
+			int32_t index, count;
+			double t;
+		};
+		Entry stack[1 + max_depth * (N - 1)];
+		int sp = 0;
+		stack[sp++] = {index, count, 0.0};
+		while (sp)
+		{
+			auto e = stack[--sp];
+			if (e.t > tmax)
+				continue;
+			if (e.count)
+			{
+				for (int32_t i = e.index; i < e.index + e.count; ++i)
+					f(i);
+				continue;
+			}
+
+			auto const &node = nodes_[e.index];
+			alignas(64) double tnear[N];
+			uint32_t mask =
+			    intersect_children(node, origin, inv_dir, tmax, tnear);
+			int base = sp;
+			for (; mask; mask &= mask - 1)
+			{
+				int k = __builtin_ctz(mask);
+				auto c = Entry{node.index[k], node.count[k], tnear[k]};
+				int p = sp++;
+				assert(sp <= 1 + max_depth * (N - 1));
+				for (; p > base && stack[p - 1].t < c.t; --p)
+					stack[p] = stack[p - 1];
+				stack[p] = c;
+			}
+		}
+	}
+
+	/** any_of() of the subtree at 'index' */
+	template <typename F>
+	bool any_of_from(int32_t index, vec3 const &origin, vec3 const &inv_dir,
+	                 double tmax, F &&f) const
+	{
+		int32_t stack[1 + max_depth * (N - 1)];
+		int sp = 0;
+		stack[sp++] = index;
+		while (sp)
+		{
+			auto const &node = nodes_[stack[--sp]];
+			alignas(64) double tnear[N];
+			uint32_t mask =
+			    intersect_children(node, origin, inv_dir, tmax, tnear);
+			for (; mask; mask &= mask - 1)
+			{
+				int k = __builtin_ctz(mask);
+				if (node.count[k] == 0)
+				{
+					assert(sp < 1 + max_depth * (N - 1));
+					stack[sp++] = node.index[k];
+					continue;
+				}
+				for (int32_t i = node.index[k];
+				     i < node.index[k] + node.count[k]; ++i)
+					if (f(i))
+						return true;
+			}
+		}
+		return false;
+	}
+
+  public:
+	WideBVH() = default;
+	explicit WideBVH(BVH const &bvh);
+
+	/** number of primitives */
+	size_t size() const { return prims_.size(); }
+	size_t node_count() const { return nodes_.size(); }
+	std::vector<Node> const &nodes() const { return nodes_; }
+
+	/** box of all primitives (as stored, i.e. rounded outwards) */
+	AABB bounds() const
+	{
+		AABB box;
+		if (nodes_.empty())
+			return box;
+		auto &root = nodes_[0];
+		for (int k = 0; k < root.size; ++k)
+			box.extend(AABB(
+			    {decode(root, root.lo[0][k], 0), decode(root, root.lo[1][k], 1),
+			     decode(root, root.lo[2][k], 2)},
+			    {decode(root, root.hi[0][k], 0), decode(root, root.hi[1][k], 1),
+			     decode(root, root.hi[2][k], 2)}));
+		return box;
+	}
+
+	/** primitive order, i.e. leaf position -> original index */
+	std::vector<int32_t> const &primitives() const { return prims_; }
+
+	/** same as BVH::traverse */
+	template <typename F>
+	void traverse(Ray const &ray, double const &tmax, F &&f) const
+	{
+		if (nodes_.empty())
+			return;
+		traverse_from(0, 0, ray.origin, inverse(ray.dir), tmax, f);
+	}
+
+	/** same as BVH::any_of */
+	template <typename F>
+	bool any_of(Ray const &ray, double tmax, F &&f) const
+	{
+		if (nodes_.empty())
+			return false;
+		return any_of_from(0, ray.origin, inverse(ray.dir), tmax, f);
+	}
+
+	/**
+	 * Packet version of traverse(). Calls 'f(i, lanes)' for primitives in
+	 * leaves hit by any of the rays in 'mask', where 'lanes' are the rays
+	 * that hit the leaf. 'tmax[k]' is the segment length of ray k, which 'f'
+	 * may shrink. All rays share one traversal order (nearest child first,
+	 * by the nearest of the rays).
+	 */
+	template <typename F>
+	void traverse(RayPacket const &packet, uint32_t mask, double const *tmax,
+	              F &&f) const
+	{
+		constexpr int K = RayPacket::size;
+		if (nodes_.empty() || !mask)
+			return;
+
+		vec3 origin[K], inv_dir[K];
+		for_each_lane(mask, [&](int k) {
+			auto ray = packet[k];
+			origin[k] = ray.origin;
+			inv_dir[k] = inverse(ray.dir);
+		});
+
+		struct Entry
+		{
+			int32_t index, count;
+			uint32_t lanes;
+			double t; // nearest entry point of all lanes
+		};
+		Entry stack[1 + max_depth * (N - 1)];
+		int sp = 0;
+		stack[sp++] = {0, 0, mask, 0.0};
+		while (sp)
+		{
+			auto e = stack[--sp];
+			uint32_t lanes = 0;
+			for_each_lane(e.lanes, [&](int k) {
+				if (e.t <= tmax[k])
+					lanes |= 1u << k;
+			});
+			if (!lanes)
+				continue;
+
+			// a single ray left, so no need to share traversal decisions
+			if (!(lanes & (lanes - 1)))
+			{
+				int k = __builtin_ctz(lanes);
+				traverse_from(e.index, e.count, origin[k], inv_dir[k], tmax[k],
+				              [&](int32_t i) { f(i, lanes); });
+				continue;
+			}
+
+			if (e.count)
+			{
+				for (int32_t i = e.index; i < e.index + e.count; ++i)
+					f(i, lanes);
+				continue;
+			}
+
+			auto const &node = nodes_[e.index];
+			uint32_t child_lanes[N] = {};
+			double child_t[N];
+			for (int c = 0; c < N; ++c)
+				child_t[c] = std::numeric_limits<double>::infinity();
+			for_each_lane(lanes, [&](int k) {
+				alignas(64) double tnear[N];
+				uint32_t m = intersect_children(node, origin[k], inv_dir[k],
+				                                tmax[k], tnear);
+				for (; m; m &= m - 1)
+				{
+					int c = __builtin_ctz(m);
+					child_lanes[c] |= 1u << k;
+					child_t[c] = std::min(child_t[c], tnear[c]);
+				}
+			});
+
+			int base = sp;
+			for (int c = 0; c < node.size; ++c)
+			{
+				if (!child_lanes[c])
+					continue;
+				auto x = Entry{node.index[c], node.count[c], child_lanes[c],
+				               child_t[c]};
+				int p = sp++;
+				assert(sp <= 1 + max_depth * (N - 1));
+				for (; p > base && stack[p - 1].t < x.t; --p)
+					stack[p] = stack[p - 1];
+				stack[p] = x;
+			}
+		}
+	}
+
+	/**
+	 * Packet version of any_of(). 'f(i, lanes)' returns the subset of
+	 * 'lanes' that are blocked by primitive i. Returns all blocked rays of
+	 * 'mask'. Rays drop out of the traversal as soon as they are blocked.
+	 */
+	template <typename F>
+	uint32_t any_of(RayPacket const &packet, uint32_t mask,
+	                double const *tmax, F &&f) const
+	{
+		constexpr int K = RayPacket::size;
+		if (nodes_.empty() || !mask)
+			return 0;
+
+		vec3 origin[K], inv_dir[K];
+		for_each_lane(mask, [&](int k) {
+			auto ray = packet[k];
+			origin[k] = ray.origin;
+			inv_dir[k] = inverse(ray.dir);
+		});
+
+		uint32_t blocked = 0;
+		std::pair<int32_t, uint32_t> stack[1 + max_depth * (N - 1)];
+		int sp = 0;
+		stack[sp++] = {0, mask};
+		while (sp)
+		{
+			auto [index, lanes] = stack[--sp];
+			lanes &= ~blocked;
+			if (!lanes)
+				continue;
+
+			// a single ray left, so no need to share traversal decisions
+			if (!(lanes & (lanes - 1)))
+			{
+				int k = __builtin_ctz(lanes);
+				if (any_of_from(index, origin[k], inv_dir[k], tmax[k],
+				                [&](int32_t i) { return f(i, lanes) != 0; }))
+					blocked |= lanes;
+				if (blocked == mask)
+					return blocked;
+				continue;
+			}
+
+			auto const &node = nodes_[index];
+			uint32_t child_lanes[N] = {};
+			for_each_lane(lanes, [&](int k) {
+				alignas(64) double tnear[N];
+				uint32_t m = intersect_children(node, origin[k], inv_dir[k],
+				                                tmax[k], tnear);
+				for (; m; m &= m - 1)
+					child_lanes[__builtin_ctz(m)] |= 1u << k;
+			});
+
+			for (int c = 0; c < node.size; ++c)
+			{
+				if (!child_lanes[c])
+					continue;
+				if (node.count[c] == 0)
+				{
+					assert(sp < 1 + max_depth * (N - 1));
+					stack[sp++] = {node.index[c], child_lanes[c]};
+					continue;
+				}
+				for (int32_t i = node.index[c];
+				     i < node.index[c] + node.count[c]; ++i)
+				{
+					uint32_t open = child_lanes[c] & ~blocked;
+					if (!open)
+						break;
+					blocked |= f(i, open);
+				}
+				if (blocked == mask)
+					return blocked;
+			}
+		}
+		return blocked;
+	}
+};
+
+/** widest BVH that the target has SIMD instructions for */
+#ifdef __AVX512F__
+constexpr int bvh_width = 8;
+#else
+constexpr int bvh_width = 4;
+#endif
+
+/** box precision of the WideBVH in geometry (see WideBVH, storage_real) */
+using bvh_real = storage_real;
+
+} // namespace ray
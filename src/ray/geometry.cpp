@@ -1,5 +1,6 @@
 #include "ray/geometry.h"
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 
@@ -8,8 +9,6 @@ namespace ray {
 /**
  * Solve x^3 + b x^2 + c x + d = 0.
  * In case of multiple real solutions, returns the largest one.
- * In particular for d > 0 it should always return a positive number.
- * (doesnt work right now due to numerical instabilities close to d=0)
  */
 double solve_cubic(double b, double c, double d)
 {
@@ -23,9 +22,11 @@ double solve_cubic(double b, double c, double d)
 	double u;
 	if (D > 0)
 	{
-		// one real root and one complex pair (Cardano's formula)
-		double tmp = std::sqrt(D);
-		u = std::cbrt(-0.5 * q + tmp) + std::cbrt(-0.5 * q - tmp);
+		// one real root and one complex pair (Cardano's formula). The two
+		// cube roots multiply to -p/3, so only the one without cancellation
+		// is computed directly.
+		double A = -std::cbrt(0.5 * q + std::copysign(std::sqrt(D), q));
+		u = A == 0 ? 0 : A - p / (3. * A);
 	}
 	else
 	{
@@ -36,8 +37,7 @@ double solve_cubic(double b, double c, double d)
 		//   1) I thinks its faster than the general 'std::pow(std::complex)'
 		//   2) we are sure to get the largest solution ("principal value")
 		auto phi = std::atan2(std::sqrt(-D), -0.5 * q);
-		assert(p <= 0);
-		u = 2. * std::sqrt(-1 / 3. * p) * std::cos(1. / 3. * phi);
+		u = 2. * std::sqrt(std::max(-1 / 3. * p, 0.)) * std::cos(1. / 3. * phi);
 	}
 
 	// note: the D==0 case could be written as
@@ -45,23 +45,45 @@ double solve_cubic(double b, double c, double d)
 	// else return {3q/p, -3q/2p, -3q/2p};
 	// but both other cases have the same limit, so why bother
 
-	// TODO:
-	//   fix the instability for d close to zero, which leads to a root close
-	//   to zero. In particular we should make sure that for negative d the
-	//   returned root is always positive (important for the quartic solver).
-
 	return u - (1. / 3.) * b;
 }
 
 std::array<double, 4> solve_quartic_depressed(double c, double d, double e)
 {
-	// solve cubic resolvent. It 'should' always return positive numbers
-	// (as long as the constant term of the cubic, -d^2, is negative).
-	// Due to rounding it can fail in practice in the current implementation.
-	double y = solve_cubic(2 * c, c * c - 4. * e, -d * d);
-	double z = std::sqrt(y);
+	// Largest root of the cubic resolvent, which is non-negative because the
+	// constant term -d^2 is not positive. Close to d = 0 the root is close
+	// to zero, where the closed formula only has an absolute accuracy, so it
+	// is polished with a Newton step, which has relative accuracy there.
+	double k1 = c * c - 4. * e;
+	double y = std::max(solve_cubic(2 * c, k1, -d * d), 0.);
+	double g = ((y + 2. * c) * y + k1) * y - d * d;
+	double dg = (3. * y + 4. * c) * y + k1;
+	if (dg > 0)
+		y = std::max(y - g / dg, 0.);
 
 	std::array<double, 4> roots = {0. / 0., 0. / 0., 0. / 0., 0. / 0.};
+	if (y == 0)
+	{
+		// biquadratic x^4 + c x^2 + e = 0 (d is zero up to rounding)
+		if (k1 < 0)
+			return roots;
+		double w1 = -0.5 * c + 0.5 * std::sqrt(k1);
+		double w2 = -0.5 * c - 0.5 * std::sqrt(k1);
+		if (w1 >= 0)
+		{
+			roots[0] = std::sqrt(w1);
+			roots[1] = -roots[0];
+		}
+		if (w2 >= 0)
+		{
+			roots[2] = std::sqrt(w2);
+			roots[3] = -roots[2];
+		}
+		return roots;
+	}
+
+	// factor into (x^2 - z x + ..)(x^2 + z x + ..) with z^2 = y
+	double z = std::sqrt(y);
 	if (double tmp = -0.5 * d / z - 0.5 * c - 0.25 * y; tmp >= 0)
 	{
 		tmp = std::sqrt(tmp);
@@ -71,8 +93,8 @@ std::array<double, 4> solve_quartic_depressed(double c, double d, double e)
 	if (double tmp = +0.5 * d / z - 0.5 * c - 0.25 * y; tmp >= 0)
 	{
 		tmp = std::sqrt(tmp);
-		roots[0] = -0.5 * z + tmp;
-		roots[1] = -0.5 * z - tmp;
+		roots[2] = -0.5 * z + tmp;
+		roots[3] = -0.5 * z - tmp;
 	}
 	return roots;
 }
@@ -118,4 +140,215 @@ bool triangle_intersect(Ray const &ray, vec3 const &origin, vec3 const &edge1,
 	return true;
 }
 
+Mesh::Mesh(std::vector<vec3> const &co, std::vector<vec3> const &no,
+           std::vector<std::array<int, 3>> const &tris,
+           Material const &material, Layout layout, Test test, Nodes nodes)
+    : Geometry(material)
+{
+	auto data = std::make_shared<Data>();
+	data_ = data; // for triangle()
+	data->count = tris.size();
+	data->test = test;
+
+	data->co.reserve(co.size());
+	for (auto &p : co)
+		data->co.push_back(to_storage(p));
+	data->no.reserve(no.size());
+	for (auto &n : no)
+		data->no.push_back(to_storage(n));
+
+	std::vector<AABB> boxes;
+	boxes.reserve(tris.size());
+	for (auto [a, b, c] : tris)
+	{
+		AABB box;
+		box.extend(to_double(data->co[a]));
+		box.extend(to_double(data->co[b]));
+		box.extend(to_double(data->co[c]));
+		boxes.push_back(box);
+	}
+
+	bool quantize = nodes == Nodes::quantized ||
+	                (nodes == Nodes::automatic && tris.size() >= quantize_min);
+	auto set_bvh = [&](BVH const &bvh) {
+		if (quantize)
+			data->bvh = QuantizedBVH(bvh);
+		else
+			data->bvh = FullBVH(bvh);
+	};
+
+	auto bvh = BVH(boxes);
+	if (layout != Layout::packed)
+		set_bvh(bvh);
+	data->tris.reserve(tris.size());
+	for (int32_t i : bvh.primitives())
+		data->tris.push_back(tris[i]);
+
+	if (layout == Layout::precomputed)
+	{
+		// (triangle() uses the indexed form while tri_data is empty)
+		std::vector<Triangle> tri_data;
+		tri_data.reserve(data->tris.size());
+		for (size_t i = 0; i < data->tris.size(); ++i)
+			tri_data.push_back(triangle((int32_t)i));
+		data->tri_data = std::move(tri_data);
+	}
+
+	if (layout == Layout::packed)
+	{
+		// consecutive triangles in BVH order form the groups, which get
+		// their own BVH (same as in SphereSet)
+		constexpr int W = TriangleGroup::width;
+		std::vector<TriangleGroup> groups((data->count + W - 1) / W);
+		std::vector<AABB> group_boxes(groups.size());
+		for (size_t g = 0; g < groups.size(); ++g)
+			for (int k = 0; k < W; ++k)
+			{
+				size_t i = g * W + k;
+				vec3 a = {0, 0, 0}, b = a, c = a;
+				if (i < data->count)
+				{
+					a = to_double(data->co[data->tris[i][0]]);
+					b = to_double(data->co[data->tris[i][1]]);
+					c = to_double(data->co[data->tris[i][2]]);
+					group_boxes[g].extend(a);
+					group_boxes[g].extend(b);
+					group_boxes[g].extend(c);
+				}
+				for (int j = 0; j < 3; ++j)
+				{
+					groups[g].a[j][k] = a[j];
+					groups[g].b[j][k] = b[j];
+					groups[g].c[j][k] = c[j];
+				}
+			}
+
+		auto group_bvh = BVH(group_boxes);
+		set_bvh(group_bvh);
+		auto order = std::move(data->tris);
+		data->tris.clear();
+		data->tris.reserve(groups.size() * W);
+		data->groups.reserve(groups.size());
+		for (int32_t g : group_bvh.primitives())
+		{
+			data->groups.push_back(groups[g]);
+			for (int k = 0; k < W; ++k)
+			{
+				size_t i = g * W + k;
+				data->tris.push_back(i < data->count ? order[i]
+				                           : std::array<int, 3>{0, 0, 0});
+			}
+		}
+	}
+}
+
+SphereSet::SphereSet(std::vector<vec3> const &centers,
+                     std::vector<double> const &radii,
+                     std::vector<Material> const &materials)
+    : count_(centers.size())
+{
+	assert(radii.size() == count_ && materials.size() == count_);
+
+	// spatial order of the spheres from a BVH over single spheres
+	std::vector<AABB> boxes;
+	boxes.reserve(count_);
+	for (size_t i = 0; i < count_; ++i)
+	{
+		auto r = vec3{radii[i], radii[i], radii[i]};
+		boxes.push_back(AABB(centers[i] - r, centers[i] + r));
+	}
+	auto order = BVH(boxes).primitives();
+
+	// consecutive spheres in that order form the groups
+	std::vector<Group> groups((count_ + width - 1) / width);
+	std::vector<AABB> group_boxes(groups.size());
+	for (size_t g = 0; g < groups.size(); ++g)
+		for (int k = 0; k < width; ++k)
+		{
+			size_t i = g * width + k;
+			for (int j = 0; j < 3; ++j)
+				groups[g].center[j][k] = i < count_ ? centers[order[i]][j] : 0;
+			groups[g].radius2[k] =
+			    i < count_ ? radii[order[i]] * radii[order[i]]
+			               : -std::numeric_limits<double>::infinity();
+			if (i < count_)
+				group_boxes[g].extend(boxes[order[i]]);
+		}
+
+	bvh_ = WideBVH<bvh_width, bvh_real>(BVH(group_boxes));
+	groups_.reserve(groups.size());
+	materials_.reserve(groups.size() * width);
+	for (int32_t g : bvh_.primitives())
+	{
+		groups_.push_back(groups[g]);
+		for (int k = 0; k < width; ++k)
+		{
+			size_t i = g * width + k;
+			materials_.push_back(i < count_ ? materials[order[i]]
+			                                : Material());
+		}
+	}
+}
+
+GeometrySet::Prim GeometrySet::insert(std::shared_ptr<const Geometry> obj)
+{
+	// copies are fine: everything is immutable after construction
+	if (auto g = dynamic_cast<Sphere const *>(obj.get()))
+	{
+		spheres_.push_back(*g);
+		return {Kind::sphere, int32_t(spheres_.size() - 1)};
+	}
+	if (auto g = dynamic_cast<Cylinder const *>(obj.get()))
+	{
+		cylinders_.push_back(*g);
+		return {Kind::cylinder, int32_t(cylinders_.size() - 1)};
+	}
+	if (auto g = dynamic_cast<Torus const *>(obj.get()))
+	{
+		tori_.push_back(*g);
+		return {Kind::torus, int32_t(tori_.size() - 1)};
+	}
+	if (auto g = dynamic_cast<Plane const *>(obj.get()))
+	{
+		planes_.push_back(*g);
+		return {Kind::plane, int32_t(planes_.size() - 1)};
+	}
+	if (auto g = dynamic_cast<Mesh const *>(obj.get()))
+	{
+		meshes_.push_back(*g);
+		return {Kind::mesh, int32_t(meshes_.size() - 1)};
+	}
+	others_.push_back(std::move(obj));
+	return {Kind::other, int32_t(others_.size() - 1)};
+}
+
+void GeometrySet::build()
+{
+	// infinite objects can not be put into the BVH, so they are kept aside
+	// and always tested
+	std::vector<std::shared_ptr<const Geometry>> bounded;
+	std::vector<AABB> boxes;
+	for (auto &obj : objects_)
+	{
+		if (obj->material().glows() && obj->can_sample_direction())
+			lights_.push_back(obj);
+
+		auto box = obj->bounds();
+		if (box.finite())
+		{
+			bounded.push_back(std::move(obj));
+			boxes.push_back(box);
+			bounds_.extend(box);
+		}
+		else
+			unbounded_.push_back(insert(std::move(obj)));
+	}
+	objects_.clear();
+
+	// converting in BVH order keeps each primitive array in that order too
+	bvh_ = WideBVH<bvh_width, bvh_real>(BVH(boxes));
+	for (int32_t i : bvh_.primitives())
+		bounded_.push_back(insert(std::move(bounded[i])));
+}
+
 } // namespace ray
@@ -38,27 +38,34 @@ vec3 Material::glow(vec3 const &in, vec3 const &normal, vec2 const &uv) const
 	return glow_->sample(uv);
 }
 
+vec3 Material::diffuse(vec2 const &uv) const
+{
+	if (!diffuse_)
+		return {0, 0, 0};
+	return diffuse_->sample(uv);
+}
+
 bool Material::scatter_diffuse(vec3 const &in, vec3 const &normal,
                                vec2 const &uv, vec3 &out, vec3 &attenuation,
-                               RNG &rng) const
+                               Sampler &sampler) const
 {
 	(void)in;
 	if (!diffuse_)
 		return false;
-	out = util::normalize(normal + random_sphere(rng));
+	out = sample_cosine_hemisphere(normal, sampler.next_2d());
 	attenuation = diffuse_->sample(uv);
 	return true;
 }
 
 bool Material::scatter_reflective(vec3 const &in, vec3 const &normal,
                                   vec2 const &uv, vec3 &out, vec3 &attenuation,
-                                  RNG &rng) const
+                                  Sampler &sampler) const
 {
 	if (!reflective_)
 		return false;
 
 	out = util::normalize(util::reflect(in, normal));
-	out += fuzz_ * random_sphere(rng);
+	out += fuzz_ * sample_sphere(sampler.next_2d());
 	out = util::normalize(out);
 
 	if (util::dot(out, normal) <= 0)
@@ -68,4 +75,36 @@ bool Material::scatter_reflective(vec3 const &in, vec3 const &normal,
 	return true;
 }
 
+Material::Lobe Material::scatter(vec3 const &in, vec3 const &normal,
+                                 vec2 const &uv, vec3 &out, vec3 &attenuation,
+                                 Sampler &sampler) const
+{
+	auto weight = [&](std::shared_ptr<const TextureBase> const &tex) {
+		if (!tex)
+			return 0.0;
+		auto c = tex->sample(uv);
+		return c.x + c.y + c.z;
+	};
+	double wd = weight(diffuse_);
+	double wr = weight(reflective_);
+	if (!(wd + wr > 0))
+		return Lobe::none;
+
+	double p = wd / (wd + wr);
+	if (sampler.next() < p)
+	{
+		if (!scatter_diffuse(in, normal, uv, out, attenuation, sampler))
+			return Lobe::none;
+		attenuation /= p;
+		return Lobe::diffuse;
+	}
+	else
+	{
+		if (!scatter_reflective(in, normal, uv, out, attenuation, sampler))
+			return Lobe::none;
+		attenuation /= 1.0 - p;
+		return Lobe::reflective;
+	}
+}
+
 } // namespace ray
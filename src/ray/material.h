@@ -1,5 +1,6 @@
 #pragma once
 
+#include "ray/sampler.h"
 #include "ray/texture.h"
 #include "ray/types.h"
 
@@ -16,10 +17,33 @@ class Material
 	explicit Material(){};
 	explicit Material(json const &j);
 	vec3 glow(vec3 const &in, vec3 const &normal, vec2 const &uv) const;
+	bool glows() const { return glow_ != nullptr; }
+
+	/** diffuse albedo (zero if there is no diffuse component) */
+	vec3 diffuse(vec2 const &uv) const;
 	bool scatter_diffuse(vec3 const &in, vec3 const &normal, vec2 const &uv,
-	                     vec3 &out, vec3 &attenuation, RNG &rng) const;
+	                     vec3 &out, vec3 &attenuation,
+	                     Sampler &sampler) const;
 	bool scatter_reflective(vec3 const &in, vec3 const &normal, vec2 const &uv,
-	                        vec3 &out, vec3 &attenuation, RNG &rng) const;
+	                        vec3 &out, vec3 &attenuation,
+	                        Sampler &sampler) const;
+
+	enum class Lobe
+	{
+		none,
+		diffuse,
+		reflective
+	};
+
+	/**
+	 * Scatter into one randomly chosen lobe (diffuse or reflective), with
+	 * probability proportional to the lobe's attenuation. The returned
+	 * attenuation is divided by that probability, so the expectation is the
+	 * same as the sum of both lobes. Returns the chosen lobe, or 'none' if
+	 * the path ends here.
+	 */
+	Lobe scatter(vec3 const &in, vec3 const &normal, vec2 const &uv,
+	             vec3 &out, vec3 &attenuation, Sampler &sampler) const;
 };
 
 } // namespace ray
@@ -0,0 +1,73 @@
+#pragma once
+
+/**
+ * Packets of rays that are traced together. Rays are stored as
+ * structure-of-arrays, such that loops over the rays of a packet vectorize.
+ * Which rays of a packet take part in an operation is given by a bitmask.
+ */
+
+#include "ray/types.h"
+#include <cstdint>
+
+namespace ray {
+
+/** number of rays in a packet (one row of a tile) */
+constexpr int packet_size = 8;
+
+struct RayPacket
+{
+	static constexpr int size = packet_size;
+
+	alignas(64) double origin[3][size] = {};
+	alignas(64) double dir[3][size] = {};
+
+	Ray operator[](int k) const
+	{
+		return Ray({origin[0][k], origin[1][k], origin[2][k]},
+		           {dir[0][k], dir[1][k], dir[2][k]});
+	}
+
+	void set(int k, Ray const &ray)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			origin[i][k] = ray.origin[i];
+			dir[i][k] = ray.dir[i];
+		}
+	}
+
+	/** transformed() without rotation */
+	RayPacket translated(vec3 const &offset) const
+	{
+		RayPacket r = *this;
+		for (int i = 0; i < 3; ++i)
+			for (int k = 0; k < size; ++k)
+				r.origin[i][k] -= offset[i];
+		return r;
+	}
+
+	/** same transformation as for single rays in Geometry */
+	RayPacket transformed(mat3 const &rot, vec3 const &offset) const
+	{
+		RayPacket r;
+		for (int i = 0; i < 3; ++i)
+			for (int k = 0; k < size; ++k)
+			{
+				r.origin[i][k] = rot(i, 0) * (origin[0][k] - offset[0]) +
+				                 rot(i, 1) * (origin[1][k] - offset[1]) +
+				                 rot(i, 2) * (origin[2][k] - offset[2]);
+				r.dir[i][k] = rot(i, 0) * dir[0][k] + rot(i, 1) * dir[1][k] +
+				              rot(i, 2) * dir[2][k];
+			}
+		return r;
+	}
+};
+
+/** calls f(k) for every bit k set in mask */
+template <typename F> void for_each_lane(uint32_t mask, F &&f)
+{
+	for (; mask; mask &= mask - 1)
+		f(__builtin_ctz(mask));
+}
+
+} // namespace ray
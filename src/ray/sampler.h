@@ -0,0 +1,141 @@
+#pragma once
+
+/**
+ * Sample values for the Monte-Carlo integration, either plain random or from
+ * a low-discrepancy sequence.
+ *
+ * The low-discrepancy mode uses the first two dimensions of the Sobol
+ * sequence with hash-based Owen scrambling, following Burley, "Practical
+ * Hash-based Owen Scrambling" (JCGT 2020). Every dimension (i.e. every call
+ * to next() / next_2d()) uses its own independent scrambling and shuffling of
+ * the sample index, which decorrelates dimensions ("padding") while keeping
+ * the samples of a pixel well stratified in each of them.
+ */
+
+#include "ray/types.h"
+#include <cstdint>
+
+namespace ray {
+
+namespace sobol {
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+	x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+inline uint32_t hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+	return seed ^ (v + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+/** permutation where each bit only depends on lower bits */
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47c;
+	x ^= x * 0xb82f1e52;
+	x ^= x * 0xc7afe638;
+	x ^= x * 0x8d22f6e6;
+	return x;
+}
+
+/** Owen scrambling of a 32 bit fixed-point number in [0, 1) */
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+/** first dimension of the Sobol sequence (van der Corput) */
+inline uint32_t sobol0(uint32_t i) { return reverse_bits(i); }
+
+/** second dimension of the Sobol sequence */
+inline uint32_t sobol1(uint32_t i)
+{
+	uint32_t r = 0;
+	for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1)
+		if (i & 1)
+			r ^= v;
+	return r;
+}
+
+inline double to_double(uint32_t x) { return x * (1.0 / 4294967296.0); }
+
+} // namespace sobol
+
+class Sampler
+{
+	RNG &rng_;
+	bool sobol_;
+	uint32_t seed_ = 0;  // per pixel
+	uint32_t index_ = 0; // sample number within the pixel
+	int dim_ = 0;
+
+  public:
+	// dimensions reserved for the camera and for each bounce of a path
+	static constexpr int camera_dims = 1;
+	static constexpr int bounce_dims = 8;
+
+	/** without 'sobol', all values simply come from 'rng' */
+	Sampler(RNG &rng, bool sobol) : rng_(rng), sobol_(sobol) {}
+
+	/** start the 'index'th sample of pixel (i, j) */
+	void start_pixel(int i, int j, uint32_t index)
+	{
+		seed_ = sobol::hash(sobol::hash_combine(sobol::hash(i), j));
+		index_ = index;
+		dim_ = 0;
+	}
+
+	/**
+	 * Start a bounce. Each bounce uses a fixed range of dimensions, so that
+	 * paths of different lengths stay aligned.
+	 */
+	void start_bounce(int bounce)
+	{
+		dim_ = camera_dims + bounce * bounce_dims;
+	}
+
+	/** uniform number in [0, 1) */
+	double next()
+	{
+		if (!sobol_)
+			return random_uniform(rng_);
+		uint32_t seed = sobol::hash_combine(seed_, dim_++);
+		uint32_t index = sobol::nested_uniform_scramble(index_, seed);
+		uint32_t x = sobol::sobol0(index);
+		return sobol::to_double(
+		    sobol::nested_uniform_scramble(x, sobol::hash(seed)));
+	}
+
+	/** uniform point in [0, 1)^2 */
+	vec2 next_2d()
+	{
+		if (!sobol_)
+			return vec2(random_uniform(rng_), random_uniform(rng_));
+		uint32_t seed = sobol::hash_combine(seed_, dim_++);
+		uint32_t index = sobol::nested_uniform_scramble(index_, seed);
+		uint32_t x = sobol::sobol0(index);
+		uint32_t y = sobol::sobol1(index);
+		return vec2(sobol::to_double(sobol::nested_uniform_scramble(
+		                x, sobol::hash_combine(seed, 0))),
+		            sobol::to_double(sobol::nested_uniform_scramble(
+		                y, sobol::hash_combine(seed, 1))));
+	}
+};
+
+} // namespace ray
@@ -1,12 +1,23 @@
 #include "ray/scene.h"
 
 #include <fstream>
+#include <map>
+#include <stdexcept>
 
 namespace ray {
 
 namespace {
 
-std::shared_ptr<Geometry> parse_object(const json &j)
+/** minimum number of spheres to put them into a SphereSet */
+constexpr size_t sphere_set_min = 16;
+
+/**
+ * Meshes by their parameters. Objects with the same parameters become
+ * instances of the first one, sharing its triangles and BVH.
+ */
+using MeshCache = std::map<std::string, std::shared_ptr<const Mesh>>;
+
+std::shared_ptr<Geometry> parse_object(const json &j, MeshCache &meshes)
 {
 	auto mat = Material(j.at("material"));
 	std::shared_ptr<Geometry> geom;
@@ -40,7 +51,34 @@ std::shared_ptr<Geometry> parse_object(const json &j)
 		auto q = j.at("q").get<int>();
 		auto n = j.at("n").get<int>();
 		auto m = j.at("m").get<int>();
-		geom = torus_knot(p, q, n, m, mat);
+		auto name = j.value<std::string>("layout", "packed");
+		if (name != "indexed" && name != "precomputed" && name != "packed")
+			throw std::runtime_error(
+			    fmt::format("unknown mesh layout '{}'", name));
+		auto layout = name == "indexed"       ? Mesh::Layout::indexed
+		              : name == "precomputed" ? Mesh::Layout::precomputed
+		                                      : Mesh::Layout::packed;
+		auto test_name = j.value<std::string>("test", "fast");
+		if (test_name != "fast" && test_name != "watertight" &&
+		    test_name != "two_sided")
+			throw std::runtime_error(
+			    fmt::format("unknown triangle test '{}'", test_name));
+		auto test = test_name == "watertight"  ? Mesh::Test::watertight
+		            : test_name == "two_sided" ? Mesh::Test::two_sided
+		                                       : Mesh::Test::fast;
+		auto nodes_name = j.value<std::string>("nodes", "auto");
+		if (nodes_name != "auto" && nodes_name != "full" &&
+		    nodes_name != "quantized")
+			throw std::runtime_error(
+			    fmt::format("unknown BVH node format '{}'", nodes_name));
+		auto nodes = nodes_name == "full"        ? Mesh::Nodes::full
+		             : nodes_name == "quantized" ? Mesh::Nodes::quantized
+		                                         : Mesh::Nodes::automatic;
+		auto &mesh = meshes[fmt::format("torus_knot {} {} {} {} {} {} {}", p,
+		                                q, n, m, name, test_name, nodes_name)];
+		if (!mesh)
+			mesh = torus_knot(p, q, n, m, mat, layout, test, nodes);
+		geom = std::make_shared<Mesh>(*mesh, mat);
 	}
 	else
 		assert(false);
@@ -57,15 +95,48 @@ GeometrySet load_scene(std::string const &filename)
 	json j;
 	file >> j;
 
+	// Spheres are collected into a SphereSet if there are enough of them.
+	// Glowing ones are kept separate, as lights need sample_direction().
+	// (There are no rotations in scene files, otherwise they would have to
+	// be excluded as well.)
+	std::vector<json const *> spheres;
+	MeshCache meshes;
+
 	GeometrySet world;
 	for (auto const &obj : j["objects"])
 	{
-		auto geom = parse_object(obj);
+		// (same condition as Material::glows(), without loading textures)
+		if (obj.at("type") == "sphere" && !obj.at("material").count("glow"))
+		{
+			spheres.push_back(&obj);
+			continue;
+		}
+
+		auto geom = parse_object(obj, meshes);
 		if (!geom)
 			continue;
 
 		world.add(geom);
 	}
+
+	if (spheres.size() >= sphere_set_min)
+	{
+		std::vector<vec3> centers;
+		std::vector<double> radii;
+		std::vector<Material> materials;
+		for (auto obj : spheres)
+		{
+			centers.push_back(obj->value<vec3>("origin", {0, 0, 0}));
+			radii.push_back(obj->value<double>("radius", 0.5));
+			materials.push_back(Material(obj->at("material")));
+		}
+		world.add(std::make_shared<SphereSet>(centers, radii, materials));
+	}
+	else
+		for (auto obj : spheres)
+			world.add(parse_object(*obj, meshes));
+
+	world.build();
 	return world;
 }
 } // namespace ray
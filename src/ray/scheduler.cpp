@@ -0,0 +1,62 @@
+#include "ray/scheduler.h"
+
+#include <cassert>
+
+namespace ray {
+
+Scheduler::Scheduler(int thread_count)
+    : thread_count_(thread_count), ranges_(new Range[thread_count])
+{
+	assert(thread_count > 0);
+	reset(0);
+}
+
+void Scheduler::reset(int32_t n)
+{
+	assert(n >= 0);
+	for (int k = 0; k < thread_count_; ++k)
+	{
+		auto begin = (uint32_t)((int64_t)n * k / thread_count_);
+		auto end = (uint32_t)((int64_t)n * (k + 1) / thread_count_);
+		ranges_[k].value.store(pack(begin, end));
+	}
+}
+
+bool Scheduler::next(int k, int32_t &item, bool &stolen)
+{
+	// take the first item of our own range
+	auto &own = ranges_[k].value;
+	uint64_t r = own.load();
+	while ((uint32_t)r < (uint32_t)(r >> 32))
+		if (own.compare_exchange_weak(r, r + 1))
+		{
+			item = (int32_t)(uint32_t)r;
+			stolen = false;
+			return true;
+		}
+
+	// own range is empty, so steal the upper half of someone else's. Only the
+	// owner ever writes to an empty range, so a plain store is fine for that.
+	for (int i = 1; i < thread_count_; ++i)
+	{
+		auto &victim = ranges_[(k + i) % thread_count_].value;
+		uint64_t v = victim.load();
+		while (true)
+		{
+			uint32_t begin = (uint32_t)v, end = (uint32_t)(v >> 32);
+			if (begin >= end)
+				break;
+			uint32_t mid = begin + (end - begin) / 2;
+			if (victim.compare_exchange_weak(v, pack(begin, mid)))
+			{
+				own.store(pack(mid + 1, end));
+				item = (int32_t)mid;
+				stolen = true;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+} // namespace ray
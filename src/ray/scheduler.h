@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace ray {
+
+/**
+ * Distributes work items [0, n) over a fixed number of threads. Every thread
+ * starts out with a contiguous range of items, which it processes in order.
+ * Threads that run out of work steal the upper half of the remaining range
+ * of another thread. So neighbouring items tend to be processed by the same
+ * thread, while the load is still balanced dynamically.
+ */
+class Scheduler
+{
+	// remaining range of one thread, packed as (end << 32 | begin) such that
+	// owner and thieves can both modify it with a single CAS
+	struct alignas(64) Range
+	{
+		std::atomic<uint64_t> value;
+	};
+
+	int thread_count_;
+	std::unique_ptr<Range[]> ranges_;
+
+	static uint64_t pack(uint32_t begin, uint32_t end)
+	{
+		return (uint64_t)end << 32 | begin;
+	}
+
+  public:
+	explicit Scheduler(int thread_count);
+
+	/** (re-)start distribution of items [0, n). Not thread-safe */
+	void reset(int32_t n);
+
+	/**
+	 * Get next item for thread k. Returns false if no work is left. Sets
+	 * 'stolen' if the item came from another thread's range.
+	 */
+	bool next(int k, int32_t &item, bool &stolen);
+};
+
+} // namespace ray
@@ -15,6 +15,18 @@ using vec2 = util::Vector<double, 2>;
 using mat3 = util::Matrix<double, 3>;
 using RNG = util::xoshiro256;
 
+/**
+ * Scalar type of bulk geometry data (mesh vertices and normals, BVH boxes).
+ * Single precision halves the memory, while all arithmetic stays in double.
+ * Selected at compile time with the RAY_FLOAT_STORAGE build option.
+ */
+#ifdef RAY_FLOAT_STORAGE
+using storage_real = float;
+#else
+using storage_real = double;
+#endif
+using vec3s = util::Vector<storage_real, 3>; // storage only
+
 struct Ray
 {
 	vec3 origin, dir;
@@ -24,6 +36,25 @@ struct Ray
 	Ray(vec3 const &origin, vec3 const &dir) : origin(origin), dir(dir) {}
 };
 
+inline vec3s to_storage(vec3 const &v)
+{
+	return vec3s{(storage_real)v.x, (storage_real)v.y, (storage_real)v.z};
+}
+inline vec3 to_double(vec3s const &v) { return vec3{v.x, v.y, v.z}; }
+
+/**
+ * Complete the unit vector n to an orthonormal basis (b1, b2, n). Branchless
+ * construction from Duff et al, "Building an Orthonormal Basis, Revisited"
+ */
+inline void orthonormal_basis(vec3 const &n, vec3 &b1, vec3 &b2)
+{
+	double sign = std::copysign(1.0, n.z);
+	double a = -1.0 / (sign + n.z);
+	double b = n.x * n.y * a;
+	b1 = vec3{1.0 + sign * n.x * n.x * a, sign * b, -sign * n.x};
+	b2 = vec3{b, sign + n.y * n.y * a, -n.y};
+}
+
 /** random point on unit sphere */
 inline vec3 random_sphere(RNG &rng)
 {
@@ -37,6 +68,79 @@ inline vec3 random_sphere(RNG &rng)
 	return r;
 }
 
+/** uniform random number in [0, 1), using the upper 53 bits of the RNG */
+inline double random_uniform(RNG &rng)
+{
+	return (double)(rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Cosine and sine of 2*pi*u for u in [0, 1). Branch-free and without calls
+ * into libm: Taylor polynomials for half the angle (in [-pi/2, pi/2)) and
+ * the double-angle formulas. Absolute error is below 1e-8.
+ */
+inline void sincos_2pi(double u, double &c, double &s)
+{
+	// Taylor coefficients of sin(y)/y and cos(y), in powers of y^2
+	constexpr double ks[] = {1.,          -1. / 6,        1. / 120,
+	                         -1. / 5040,  1. / 362880,    -1. / 39916800,
+	                         1. / 6227020800.};
+	constexpr double kc[] = {1.,           -1. / 2,          1. / 24,
+	                         -1. / 720,    1. / 40320,       -1. / 3628800,
+	                         1. / 479001600, -1. / 87178291200.};
+
+	double y = 3.141592653589793 * (u - 0.5); // half of 2*pi*u - pi
+	double y2 = y * y;
+	double sy = ks[6];
+	for (int i = 5; i >= 0; --i)
+		sy = sy * y2 + ks[i];
+	sy *= y;
+	double cy = kc[7];
+	for (int i = 6; i >= 0; --i)
+		cy = cy * y2 + kc[i];
+
+	// angle is shifted by pi, which flips both signs
+	s = -2. * sy * cy;
+	c = 2. * sy * sy - 1.;
+}
+
+/**
+ * Direction in the hemisphere around the unit vector n, with density
+ * cos(theta)/pi, from a uniform point u in [0, 1)^2 (Malley's method on a
+ * basis around n). Area-preserving, so stratification of u carries over.
+ */
+inline vec3 sample_cosine_hemisphere(vec3 const &n, vec2 const &u)
+{
+	double r2 = u.x;
+	double c, s;
+	sincos_2pi(u.y, c, s);
+	double r = std::sqrt(r2);
+	vec3 b1, b2;
+	orthonormal_basis(n, b1, b2);
+	return (r * c) * b1 + (r * s) * b2 + std::sqrt(1. - r2) * n;
+}
+
+/**
+ * Random direction in the hemisphere around the unit vector n, with density
+ * cos(theta)/pi. Same distribution as normalize(n + random_sphere()), but
+ * cheaper.
+ */
+inline vec3 random_cosine_hemisphere(vec3 const &n, RNG &rng)
+{
+	return sample_cosine_hemisphere(
+	    n, vec2(random_uniform(rng), random_uniform(rng)));
+}
+
+/** point on the unit sphere from a uniform point u in [0, 1)^2 */
+inline vec3 sample_sphere(vec2 const &u)
+{
+	double z = 2. * u.x - 1.;
+	double c, s;
+	sincos_2pi(u.y, c, s);
+	double r = std::sqrt(1. - z * z);
+	return vec3{r * c, r * s, z};
+}
+
 } // namespace ray
 
 template <> struct fmt::formatter<ray::vec3>